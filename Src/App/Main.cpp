@@ -2,6 +2,7 @@
 
 //#include "Window/MainWindow.h"
 #include "Window/MyGraphicView.h"
+#include "Window/TimelinePanel/TimelineWidget.h"
 
 int main(int argc, char* argv[])
 {
@@ -10,5 +11,8 @@ int main(int argc, char* argv[])
     MyGraphicView w;
     w.show();
 
+    TimelineWidget timeline;
+    timeline.show();
+
     return a.exec();
 }
@@ -0,0 +1,41 @@
+#include "SyntheticPreviewProvider.h"
+
+#include <QLinearGradient>
+#include <QPainter>
+#include <QThread>
+#include <QTime>
+
+namespace {
+
+/// Шаг, с которым имитация декодирования проверяет отмену
+const int CANCEL_CHECK_INTERVAL = 5;
+
+} // namespace
+
+SyntheticPreviewProvider::SyntheticPreviewProvider(int decodeDelay)
+    : m_decodeDelay(decodeDelay)
+{}
+
+QImage SyntheticPreviewProvider::frame(qint64 time, const QSize& size, const std::atomic<bool>& cancelled)
+{
+    for (int elapsed = 0; elapsed < m_decodeDelay; elapsed += CANCEL_CHECK_INTERVAL)
+    {
+        if (cancelled)
+            return QImage();
+        QThread::msleep(CANCEL_CHECK_INTERVAL);
+    }
+
+    QImage image(size, QImage::Format_RGB32);
+    QPainter painter(&image);
+
+    // оттенок делает полный круг за минуту, так что соседние кадры легко отличить
+    const int hue = int(time / 1000 % 60 * 6);
+    QLinearGradient gradient(image.rect().topLeft(), image.rect().bottomRight());
+    gradient.setColorAt(0, QColor::fromHsv(hue, 160, 230));
+    gradient.setColorAt(1, QColor::fromHsv((hue + 60) % 360, 200, 120));
+    painter.fillRect(image.rect(), gradient);
+
+    painter.setPen(Qt::white);
+    painter.drawText(image.rect(), Qt::AlignCenter, QTime(0, 0).addMSecs(int(time % (24 * 3600 * 1000))).toString("hh:mm:ss.zzz"));
+    return image;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "Widget/MTimelinePreview.h"
+
+/// Источник превью без видео: рисует кадр из градиента, зависящего от времени, и подписи с таймкодом.
+/// Задержка декодирования имитируется, чтобы в демо были видны отмена запросов и кэш превью.
+class SyntheticPreviewProvider : public MTimelinePreviewProvider
+{
+public:
+    explicit SyntheticPreviewProvider(int decodeDelay = 40);
+
+    QImage frame(qint64 time, const QSize& size, const std::atomic<bool>& cancelled) override;
+
+private:
+    int m_decodeDelay; ///< имитируемое время декодирования в миллисекундах
+};
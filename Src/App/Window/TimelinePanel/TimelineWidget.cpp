@@ -0,0 +1,46 @@
+#include "TimelineWidget.h"
+
+#include <QBoxLayout>
+
+#include "Widget/MTimelinePreview.h"
+#include "Widget/MTimelineSlider.h"
+#include "Widget/WidgetUtils.h"
+
+#include "SyntheticPreviewProvider.h"
+
+namespace {
+
+const qint64 DEMO_DURATION = 3600 * 1000;
+
+} // namespace
+
+struct TimelineWidget::Impl
+{
+    Impl(TimelineWidget* timelineWidget)
+        : timelineWidget(timelineWidget)
+        , CONSTRUCT_WIDGET(timelineSlider, timelineWidget)
+    {
+        timelineSlider->setTimeRange(0, DEMO_DURATION);
+        timelineSlider->setZoomEnabled(true);
+        timelineSlider->setRulerVisible(true);
+        timelineSlider->preview().setFrameSize(QSize(160, 90));
+        timelineSlider->preview().setProvider(std::make_shared<SyntheticPreviewProvider>());
+
+        QVBoxLayout* timelineWidgetLayout = Util::createZeroLayout<QVBoxLayout>(timelineWidget);
+        timelineWidgetLayout->addStretch();
+        timelineWidgetLayout->addWidget(timelineSlider);
+    }
+
+    TimelineWidget* timelineWidget;
+
+    MTimelineSlider* timelineSlider;
+};
+
+TimelineWidget::TimelineWidget(QWidget* parent)
+    : QWidget(parent)
+    , m_impl(std::make_unique<Impl>(this))
+{
+    setMinimumWidth(600);
+}
+
+TimelineWidget::~TimelineWidget() = default;
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <memory>
+
+#include <QWidget>
+
+/// Демо MTimelineSlider: часовая шкала с превью кадров от SyntheticPreviewProvider
+class TimelineWidget : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit TimelineWidget(QWidget* parent = 0);
+    ~TimelineWidget();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+};
@@ -1,15 +1,52 @@
 #include "MMagnet.h"
 #include "MSlider.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <numeric>
 #ifdef __APPLE__
 #include <cstdlib>
 #endif
 
+///////////////////////////
+// MMagnetNotifyingPoint //
+///////////////////////////
+MMagnetNotifyingPoint::~MMagnetNotifyingPoint()
+{
+	// detachPoint() убирает магнит из m_magnets, поэтому обходим копию
+	const QVector<MMagnet*> magnets = m_magnets;
+	for (MMagnet* magnet : magnets)
+		magnet->detachPoint(this);
+}
+
+void MMagnetNotifyingPoint::setPosition(int position)
+{
+	if (position == m_position)
+		return;
+
+	const int oldPosition = m_position;
+	m_position = position;
+	for (MMagnet* magnet : m_magnets)
+		magnet->pointMoved(this, oldPosition, position);
+}
+
+
+
 /////////////////////////////
 // MMagnetSliderThumbPoint //
 /////////////////////////////
-int MMagnetSliderThumbPoint::position() const
+MMagnetSliderThumbPoint::MMagnetSliderThumbPoint(MSliderThumb& thumb)
+	: MMagnetNotifyingPoint(thumb.value())
+	, m_thumb(&thumb)
+{
+	m_thumb->m_magnetPoints.append(this);
+}
+
+MMagnetSliderThumbPoint::~MMagnetSliderThumbPoint()
 {
-	return m_thumb.value();
+	if (m_thumb)
+		m_thumb->m_magnetPoints.removeOne(this);
 }
 
 
@@ -19,57 +56,260 @@ int MMagnetSliderThumbPoint::position() const
 /////////////
 MMagnet::MMagnet(int initialPosition)
 	: m_previousPosition(initialPosition)
+	, m_maxDistance(0)
+	, m_indexValid(true)
+	, m_fixedMaxDistance(0)
+	, m_zoneUnits(ValueUnits)
+	, m_valuePerPixel(1.0)
+{
+}
+
+MMagnet::~MMagnet()
 {
+	// Точки из m_points могли быть уже удалены, поэтому обходим только подписанные точки:
+	// MMagnetNotifyingPoint сама убирает себя из m_notifyingPoints в своём деструкторе
+	for (MMagnetNotifyingPoint* notifying : m_notifyingPoints)
+		notifying->m_magnets.removeOne(this);
 }
 
 void MMagnet::attachPoint(MMagnetAbstractPoint* point, const Magnetism& magnetism)
 {
+	if (!m_points.contains(point))
+		if (auto notifying = dynamic_cast<MMagnetNotifyingPoint*>(point))
+		{
+			notifying->m_magnets.append(this);
+			m_notifyingPoints.append(notifying);
+		}
+
 	m_points[point] = magnetism;
+	m_indexValid = false;
 }
 
 void MMagnet::detachPoint(MMagnetAbstractPoint* point)
 {
-	m_points.remove(point);
+	if (!m_points.remove(point))
+		return;
+
+	for (int i = 0; i < m_notifyingPoints.size(); ++i)
+	{
+		MMagnetNotifyingPoint* notifying = m_notifyingPoints.at(i);
+		if (static_cast<MMagnetAbstractPoint*>(notifying) != point)
+			continue;
+		notifying->m_magnets.removeOne(this);
+		m_notifyingPoints.remove(i);
+		break;
+	}
+	m_indexValid = false;
 }
 
-int MMagnet::moveTo(int newPosition)
+void MMagnet::setFixedPoints(const QVector<int>& positions, const Magnetism& magnetism)
+{
+	m_fixedPositions = positions;
+	std::sort(m_fixedPositions.begin(), m_fixedPositions.end());
+
+	m_fixedLeftMoveIn.clear();
+	m_fixedLeftMoveOut.clear();
+	m_fixedRightMoveIn.clear();
+	m_fixedRightMoveOut.clear();
+
+	m_fixedMagnetism = magnetism;
+	m_fixedMaxDistance = std::max({ magnetism.leftMoveIn(), magnetism.leftMoveOut(), magnetism.rightMoveIn(), magnetism.rightMoveOut() });
+}
+
+void MMagnet::setFixedPoints(const QVector<int>& positions, const QVector<Magnetism>& magnetism)
 {
+	assert(positions.size() == magnetism.size());
+	const int count = std::min(positions.size(), magnetism.size());
+
+	QVector<int> order(count);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&positions](int lhs, int rhs) {
+		return positions[lhs] < positions[rhs];
+	});
+
+	m_fixedPositions.resize(count);
+	m_fixedLeftMoveIn.resize(count);
+	m_fixedLeftMoveOut.resize(count);
+	m_fixedRightMoveIn.resize(count);
+	m_fixedRightMoveOut.resize(count);
+	m_fixedMaxDistance = 0;
+
+	for (int i = 0; i < count; ++i)
+	{
+		const Magnetism& zones = magnetism[order[i]];
+		m_fixedPositions[i]    = positions[order[i]];
+		m_fixedLeftMoveIn[i]   = zones.leftMoveIn();
+		m_fixedLeftMoveOut[i]  = zones.leftMoveOut();
+		m_fixedRightMoveIn[i]  = zones.rightMoveIn();
+		m_fixedRightMoveOut[i] = zones.rightMoveOut();
+		m_fixedMaxDistance = std::max({ m_fixedMaxDistance, zones.leftMoveIn(), zones.leftMoveOut(), zones.rightMoveIn(), zones.rightMoveOut() });
+	}
+}
+
+void MMagnet::clearFixedPoints()
+{
+	m_fixedPositions.clear();
+	m_fixedLeftMoveIn.clear();
+	m_fixedLeftMoveOut.clear();
+	m_fixedRightMoveIn.clear();
+	m_fixedRightMoveOut.clear();
+	m_fixedMaxDistance = 0;
+}
+
+MMagnet::Magnetism MMagnet::fixedMagnetism(int index) const
+{
+	if (m_fixedLeftMoveIn.isEmpty())
+		return m_fixedMagnetism;
+	return Magnetism(m_fixedLeftMoveIn[index], m_fixedLeftMoveOut[index], m_fixedRightMoveIn[index], m_fixedRightMoveOut[index]);
+}
+
+void MMagnet::pointMoved(const MMagnetAbstractPoint* point, int oldPosition, int newPosition)
+{
+	if (!m_indexValid)
+		return; // индекс всё равно будет перестроен целиком
+
+	auto byPosition = [](const IndexEntry& entry, int position) { return entry.position < position; };
+	auto at = std::lower_bound(m_index.begin(), m_index.end(), oldPosition, byPosition);
+	while (at != m_index.end() && at->position == oldPosition && at->point != point)
+		++at;
+	if (at == m_index.end() || at->point != point)
+	{
+		m_indexValid = false;
+		return;
+	}
+
+	// точка сдвигается к новому месту обменами с соседями: при плавном движении их единицы
+	at->position = newPosition;
+	while (at != m_index.begin() && (at - 1)->position > at->position)
+	{
+		std::iter_swap(at, at - 1);
+		--at;
+	}
+	while (at + 1 != m_index.end() && (at + 1)->position < at->position)
+	{
+		std::iter_swap(at, at + 1);
+		++at;
+	}
+}
+
+void MMagnet::ensureIndex()
+{
+	if (m_indexValid)
+		return;
+
+	m_index.clear();
+	m_dynamicPoints.clear();
+	m_maxDistance = 0;
+
 	typedef QMap<MMagnetAbstractPoint*, Magnetism>::const_iterator iterator;
 	for(iterator at(m_points.begin()), end(m_points.end()); at != end; ++at)
 	{
-		int magnetism = 0;
-		int pointPosition = at.key()->position();
-		int distanceFromPoint = std::abs(pointPosition - newPosition);
-
-		if(pointPosition > m_previousPosition) // left move
+		const Magnetism& magnetism = at.value();
+		if (at.key()->isDynamic())
 		{
-			if(newPosition > m_previousPosition) // move in
-				magnetism = at.value().leftMoveIn();
-			else if(newPosition < m_previousPosition) // move out
-				magnetism = at.value().leftMoveOut();
+			m_dynamicPoints.append({ at.key(), magnetism });
+			continue;
 		}
-		else if(pointPosition < m_previousPosition) // right move
+
+		m_index.append({ at.key()->position(), at.key(), magnetism });
+		m_maxDistance = std::max({ m_maxDistance, magnetism.leftMoveIn(), magnetism.leftMoveOut(), magnetism.rightMoveIn(), magnetism.rightMoveOut() });
+	}
+
+	std::sort(m_index.begin(), m_index.end(), [](const IndexEntry& lhs, const IndexEntry& rhs) {
+		return lhs.position < rhs.position;
+	});
+
+	m_indexValid = true;
+}
+
+qint64 MMagnet::zone(int pointPosition, int newPosition, const Magnetism& magnetism) const
+{
+	if(pointPosition > m_previousPosition) // left move
+	{
+		if(newPosition > m_previousPosition) // move in
+			return toValueUnits(magnetism.leftMoveIn());
+		else if(newPosition < m_previousPosition) // move out
+			return toValueUnits(magnetism.leftMoveOut());
+	}
+	else if(pointPosition < m_previousPosition) // right move
+	{
+		if(newPosition > m_previousPosition) // move out
+			return toValueUnits(magnetism.rightMoveOut());
+		else if(newPosition < m_previousPosition) // move in
+			return toValueUnits(magnetism.rightMoveIn());
+	}
+	else // detect move direction
+	{
+		if(newPosition > m_previousPosition) // right move out
+			return toValueUnits(magnetism.rightMoveOut());
+		else if(newPosition < m_previousPosition) // left move out
+			return toValueUnits(magnetism.leftMoveOut());
+	}
+	return 0;
+}
+
+qint64 MMagnet::toValueUnits(int distance) const
+{
+	if (m_zoneUnits == ValueUnits)
+		return distance;
+	return static_cast<qint64>(std::llround(distance * m_valuePerPixel));
+}
+
+int MMagnet::moveTo(int newPosition)
+{
+	ensureIndex();
+
+	bool found = false;
+	int foundPosition = newPosition;
+	qint64 foundDistance = 0;
+
+	auto consider = [&](int pointPosition, const Magnetism& magnetism) {
+		const qint64 distanceFromPoint = std::abs(static_cast<qint64>(pointPosition) - newPosition);
+		if (distanceFromPoint > zone(pointPosition, newPosition, magnetism))
+			return;
+		if (found && distanceFromPoint >= foundDistance)
+			return;
+		found = true;
+		foundPosition = pointPosition;
+		foundDistance = distanceFromPoint;
+	};
+
+	// Отсортированные точки просматриваются от newPosition в обе стороны, пока расстояние не превысит
+	// наибольшую зону или расстояние до уже найденной точки
+	auto scan = [&](int count, int split, qint64 maxDistance, auto positionAt, auto magnetismAt) {
+		for (int i = split; i < count; ++i)
 		{
-			if(newPosition > m_previousPosition) // move out
-				magnetism = at.value().rightMoveOut();
-			else if(newPosition < m_previousPosition) // move in
-				magnetism = at.value().rightMoveIn();
+			const qint64 distance = static_cast<qint64>(positionAt(i)) - newPosition;
+			if (distance > maxDistance || (found && distance >= foundDistance))
+				break;
+			consider(positionAt(i), magnetismAt(i));
 		}
-		else // detect move direction
+		for (int i = split - 1; i >= 0; --i)
 		{
-			if(newPosition > m_previousPosition) // right move out
-				magnetism = at.value().rightMoveOut();
-			else if(newPosition < m_previousPosition) // left move out
-				magnetism = at.value().leftMoveOut();
+			const qint64 distance = newPosition - static_cast<qint64>(positionAt(i));
+			if (distance > maxDistance || (found && distance >= foundDistance))
+				break;
+			consider(positionAt(i), magnetismAt(i));
 		}
+	};
 
-		if(distanceFromPoint <= magnetism)
-		{
-			// найдена точка, к которой надо примагнититься
-			newPosition = pointPosition;
-			break;
-		}
-	}
+	const int indexSplit = std::lower_bound(m_index.cbegin(), m_index.cend(), newPosition, [](const IndexEntry& entry, int position) {
+		return entry.position < position;
+	}) - m_index.cbegin();
+	scan(m_index.size(), indexSplit, toValueUnits(m_maxDistance),
+		[this](int i) { return m_index.at(i).position; },
+		[this](int i) -> const Magnetism& { return m_index.at(i).magnetism; });
+
+	const int fixedSplit = std::lower_bound(m_fixedPositions.cbegin(), m_fixedPositions.cend(), newPosition) - m_fixedPositions.cbegin();
+	scan(m_fixedPositions.size(), fixedSplit, toValueUnits(m_fixedMaxDistance),
+		[this](int i) { return m_fixedPositions.at(i); },
+		[this](int i) { return fixedMagnetism(i); });
+
+	for (const DynamicEntry& entry : m_dynamicPoints)
+		consider(entry.point->position(), entry.magnetism);
+
+	if (found)
+		newPosition = foundPosition; // найдена ближайшая точка, к которой надо примагнититься
 
 	m_previousPosition = newPosition;
 	return newPosition;
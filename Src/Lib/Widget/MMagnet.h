@@ -1,12 +1,14 @@
 #pragma once
 
 #include <QMap>
+#include <QVector>
 
 #include "MovaviWidgetLib.h"
 
 class MSliderThumb;
 class MMagnetAbstractPoint;
 class MMagnetFixedPoint;
+class MMagnetNotifyingPoint;
 class MMagnetSliderThumbPoint;
 class MMagnet;
 
@@ -19,6 +21,12 @@ public:
 
 	/// @brief Функция возвращает позиции точки к которой надо примагнититься
 	virtual int position() const = 0;
+
+	/// @brief Признак точки, позиция которой меняется сама по себе (например, вслед за ручкой слайдера)
+	/// @details Позиции обычных точек MMagnet запоминает в отсортированном индексе, и при их изменении
+	/// нужно вызвать MMagnet::invalidate(). Позиции динамических точек опрашиваются при каждом moveTo().
+	/// Для часто движущихся точек лучше использовать MMagnetNotifyingPoint: она сама обновляет индекс.
+	virtual bool isDynamic() const { return false; }
 };
 
 /// @class MMagnetFixedPoint
@@ -36,18 +44,44 @@ private:
 
 };
 
+/// @class MMagnetNotifyingPoint
+/// @brief Точка примагничивания, которая сама сообщает подключённым магнитам о смене позиции
+/// @details Магниты при этом не опрашивают position(), а сдвигают точку в своём отсортированном индексе,
+/// что стоит O(log n) плюс число точек, через которые она "перешагнула".
+class MOVAVIWIDGET_API MMagnetNotifyingPoint : public MMagnetAbstractPoint
+{
+public:
+	explicit MMagnetNotifyingPoint(int position = 0) : m_position(position) {}
+	~MMagnetNotifyingPoint();
+
+	MMagnetNotifyingPoint(const MMagnetNotifyingPoint&) = delete;
+	MMagnetNotifyingPoint& operator=(const MMagnetNotifyingPoint&) = delete;
+
+	int position() const override { return m_position; }
+
+	/// @brief Меняет позицию точки и обновляет индексы всех магнитов, к которым она подключена
+	void setPosition(int position);
+
+private:
+	friend class MMagnet;
+
+	int m_position;
+	QVector<MMagnet*> m_magnets;
+};
+
 /// @class MMagnetSliderThumbPoint
 /// @brief Класс возвращающий в качестве точки примагничивания позицию thumb'а
-class MOVAVIWIDGET_API MMagnetSliderThumbPoint : public MMagnetAbstractPoint
+/// @details Ручка сама сообщает точке о смене значения (см. MSliderThumb::setValue)
+class MOVAVIWIDGET_API MMagnetSliderThumbPoint : public MMagnetNotifyingPoint
 {
 public:
-	explicit MMagnetSliderThumbPoint(MSliderThumb& thumb) : m_thumb(thumb) {}
-
-	/// @brief Возвращает позицию (value) MSliderThumb переданного в конструкторе
-	int position() const override;
+	explicit MMagnetSliderThumbPoint(MSliderThumb& thumb);
+	~MMagnetSliderThumbPoint();
 
 private:
-	MSliderThumb& m_thumb;
+	friend class MSliderThumb;
+
+	MSliderThumb* m_thumb; ///< обнуляется, если ручка удалена раньше точки
 };
 
 
@@ -55,7 +89,10 @@ private:
 /// @brief Класс помогающий реализовать функционал "примагничивания"
 /// @details К объектам класса можно добавлять "точки примагничивания" (MMagnetAbstractPoint)
 /// указывая границы притяжения/примагничивания (подробнее в описании класса Magnetism).
-/// Функция moveTo(int newPosition) возвращает значение позиции с учётом примагничивания
+/// Функция moveTo(int newPosition) возвращает значение позиции с учётом примагничивания.
+/// Если newPosition попадает в зоны нескольких точек, выбирается ближайшая.
+/// Точки хранятся в индексе, отсортированном по позиции, поэтому moveTo() просматривает только окрестность
+/// newPosition шириной в наибольшую зону примагничивания, а не все точки.
 /// @code
 /// MMagnet magnet;
 /// MMagnetFixedPoint point1(30), point2(100);
@@ -68,6 +105,11 @@ private:
 /// magnet.moveTo(75); // returns 100 попадает в зону действия второй точки (left, moveIn)
 /// magnet.moveTo(105);// returns 105 не попадает в зону действия точек примагничивания
 /// @endcode
+/// Для большого числа неподвижных точек (например, границ всех клипов) вместо отдельных объектов
+/// MMagnetFixedPoint лучше использовать setFixedPoints(): позиции и зоны хранятся в непрерывных массивах
+/// внутри магнита, и перестроение точек после правки сводится к сортировке массива int.
+/// Зоны можно задать в пикселях (setZoneUnits(PixelUnits)): тогда они пересчитываются в единицы значения
+/// по текущему масштабу valuePerPixel() в момент moveTo(), и при зуме достаточно вызвать setValuePerPixel().
 /// @todo При желании можно написать юнит-тест, ради юнит-теста
 class MOVAVIWIDGET_API MMagnet
 {
@@ -151,8 +193,19 @@ public:
 		int m_rightMoveOut;
 	};
 
+	/// @brief Единицы, в которых заданы расстояния Magnetism
+	enum ZoneUnits
+	{
+		ValueUnits, ///< в единицах позиции (по умолчанию)
+		PixelUnits, ///< в пикселях, пересчитываются через valuePerPixel()
+	};
+
 	/// @brief Конструктор. @a initialPosition - позиция магнита
 	explicit MMagnet(int initialPosition);
+	~MMagnet();
+
+	MMagnet(const MMagnet&) = delete;
+	MMagnet& operator=(const MMagnet&) = delete;
 
 	/// @brief Подключает точку примагничивания @a point с зонами магнитизма @a magnetism
 	/// @note MMagnet не управляет временем жизни точек примагничивания. Это обязанности клиентского кода.
@@ -161,11 +214,86 @@ public:
 	/// @brief Отключает точку примагничивания @a point
 	void detachPoint(MMagnetAbstractPoint* point);
 
+	/// @name Неподвижные точки, хранимые самим магнитом
+	/// @{
+	/// @brief Заменяет неподвижные точки набором @a positions с общими зонами @a magnetism
+	void setFixedPoints(const QVector<int>& positions, const Magnetism& magnetism);
+	/// @brief Заменяет неподвижные точки набором @a positions с индивидуальными зонами (размеры массивов совпадают)
+	void setFixedPoints(const QVector<int>& positions, const QVector<Magnetism>& magnetism);
+	/// @brief Удаляет все неподвижные точки, заданные через setFixedPoints()
+	void clearFixedPoints();
+	int fixedPointCount() const { return m_fixedPositions.size(); }
+	/// @}
+
+	/// @name Масштаб зон примагничивания
+	/// @{
+	ZoneUnits zoneUnits() const { return m_zoneUnits; }
+	void setZoneUnits(ZoneUnits units) { m_zoneUnits = units; }
+
+	/// @brief Сколько единиц позиции приходится на один пиксель (для зон в PixelUnits)
+	double valuePerPixel() const { return m_valuePerPixel; }
+	void setValuePerPixel(double valuePerPixel) { m_valuePerPixel = valuePerPixel; }
+	/// @}
+
+	/// @brief Сообщает, что позиции подключённых (не динамических) точек изменились
+	/// @details Индекс будет перестроен при следующем вызове moveTo()
+	void invalidate() { m_indexValid = false; }
+
 	/// @brief Функция перемещает магнит в позицию @a newPosition
 	/// @returns Возвращает позицию магнита с учётом примагничивания
 	int moveTo(int newPosition);
 
+private:
+	friend class MMagnetNotifyingPoint;
+
+	struct IndexEntry
+	{
+		int position;
+		const MMagnetAbstractPoint* point;
+		Magnetism magnetism;
+	};
+
+	struct DynamicEntry
+	{
+		const MMagnetAbstractPoint* point;
+		Magnetism magnetism;
+	};
+
+	void ensureIndex();
+
+	/// @brief Переставляет точку @a point в индексе (вызывается из MMagnetNotifyingPoint::setPosition)
+	void pointMoved(const MMagnetAbstractPoint* point, int oldPosition, int newPosition);
+
+	/// @brief Зона притяжения точки в @a pointPosition при перемещении магнита в @a newPosition
+	qint64 zone(int pointPosition, int newPosition, const Magnetism& magnetism) const;
+
+	/// @brief Переводит расстояние зоны в единицы позиции с учётом zoneUnits()
+	qint64 toValueUnits(int distance) const;
+
+	Magnetism fixedMagnetism(int index) const;
+
 private:
 	QMap<MMagnetAbstractPoint*, Magnetism>	m_points;
+	QVector<MMagnetNotifyingPoint*> m_notifyingPoints; ///< подключённые точки, знающие о магните
 	int m_previousPosition;
+
+	QVector<IndexEntry>   m_index;         ///< не динамические точки, по возрастанию позиции
+	QVector<DynamicEntry> m_dynamicPoints;
+	int  m_maxDistance;                    ///< наибольшая зона среди точек индекса
+	bool m_indexValid;
+
+	/// @name Неподвижные точки в виде структуры массивов, отсортированы по позиции
+	/// Если массивы зон пусты, для всех точек действует m_fixedMagnetism
+	/// @{
+	QVector<int> m_fixedPositions;
+	QVector<int> m_fixedLeftMoveIn;
+	QVector<int> m_fixedLeftMoveOut;
+	QVector<int> m_fixedRightMoveIn;
+	QVector<int> m_fixedRightMoveOut;
+	Magnetism    m_fixedMagnetism;
+	int          m_fixedMaxDistance;
+	/// @}
+
+	ZoneUnits m_zoneUnits;
+	double    m_valuePerPixel;
 };
@@ -0,0 +1,808 @@
+#include "MPixmapCache.h"
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+
+#include <QCache>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QImageReader>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPainter>
+#include <QPointer>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVector>
+#include <QWidget>
+
+#include "MPixmapWidget.h"
+
+namespace {
+
+const int DEFAULT_CACHE_LIMIT       = 64 * 1024 * 1024;
+const int DEFAULT_MOVIE_CACHE_LIMIT = 32 * 1024 * 1024;
+
+/// Кадры с меньшей задержкой (в том числе нулевой) показываются не чаще, как и в браузерах
+const int MIN_FRAME_DELAY = 20;
+/// Если воспроизведение отстало больше чем на столько миллисекунд (например, подписчики были скрыты),
+/// пропущенные кадры не догоняются
+const int MAX_MOVIE_LAG = 1000;
+/// Анимации декодируются целиком и подолгу, поэтому у них свой пул: иначе они заняли бы общий пул приложения
+const int MOVIE_DECODE_THREADS = 2;
+/// Сколько последних недоступных анимаций помнить, чтобы не пытаться декодировать их снова
+const int MAX_UNAVAILABLE_MOVIES = 64;
+
+const QPainter::RenderHints RENDER_HINTS = QPainter::Antialiasing | QPainter::HighQualityAntialiasing | QPainter::SmoothPixmapTransform;
+
+/// Адресат результатов: задачи пула обращаются к нему под мьютексом,
+/// поэтому результат не попадёт в уже удалённый кэш.
+struct Receiver
+{
+	QMutex mutex;
+	QObject * cache = nullptr;
+};
+
+class RenderTask : public QRunnable
+{
+public:
+	RenderTask(std::shared_ptr<Receiver> receiver, std::shared_ptr<std::atomic<bool>> cancelled,
+		int ticket, const QImage & source, const QSize & size, int radius)
+		: m_receiver(std::move(receiver))
+		, m_cancelled(std::move(cancelled))
+		, m_ticket(ticket)
+		, m_source(source)
+		, m_size(size)
+		, m_radius(radius)
+	{ }
+
+	void run() override
+	{
+		if (*m_cancelled)
+			return;
+
+		const QImage image = MPixmapCache::renderImage(m_source, m_size, m_radius);
+		if (*m_cancelled)
+			return;
+
+		QMutexLocker locker(&m_receiver->mutex);
+		if (m_receiver->cache)
+			QMetaObject::invokeMethod(m_receiver->cache, "renderFinished", Qt::QueuedConnection, Q_ARG(int, m_ticket), Q_ARG(QImage, image));
+	}
+
+private:
+	std::shared_ptr<Receiver>          m_receiver;
+	std::shared_ptr<std::atomic<bool>> m_cancelled;
+	int    m_ticket;
+	QImage m_source;
+	QSize  m_size;
+	int    m_radius;
+};
+
+/// Декодирует изображение из файла сразу в уменьшенном и обрезанном маской виде
+class DecodeTask : public QRunnable
+{
+public:
+	DecodeTask(std::shared_ptr<Receiver> receiver, std::shared_ptr<std::atomic<bool>> cancelled,
+		int ticket, const MPixmapCacheKey & key)
+		: m_receiver(std::move(receiver))
+		, m_cancelled(std::move(cancelled))
+		, m_ticket(ticket)
+		, m_key(key)
+	{ }
+
+	void run() override
+	{
+		if (*m_cancelled)
+			return;
+
+		const QImage image = MPixmapCache::decodeImage(m_key.path, m_key.size, m_key.maskMode, m_key.maskAnchor);
+		if (*m_cancelled)
+			return;
+
+		QMutexLocker locker(&m_receiver->mutex);
+		if (m_receiver->cache)
+			QMetaObject::invokeMethod(m_receiver->cache, "renderFinished", Qt::QueuedConnection, Q_ARG(int, m_ticket), Q_ARG(QImage, image));
+	}
+
+private:
+	std::shared_ptr<Receiver>          m_receiver;
+	std::shared_ptr<std::atomic<bool>> m_cancelled;
+	int             m_ticket;
+	MPixmapCacheKey m_key;
+};
+
+/// Последовательно декодирует анимацию, сразу обрезая каждый кадр маской и масштабируя его
+class MovieDecodeTask : public QRunnable
+{
+public:
+	MovieDecodeTask(std::shared_ptr<Receiver> receiver, std::shared_ptr<std::atomic<bool>> cancelled,
+		int ticket, const MPixmapCacheKey & key)
+		: m_receiver(std::move(receiver))
+		, m_cancelled(std::move(cancelled))
+		, m_ticket(ticket)
+		, m_key(key)
+	{ }
+
+	void run() override
+	{
+		QImageReader reader(m_key.path);
+		int index = 0;
+		while (!*m_cancelled)
+		{
+			const QImage source = reader.read();
+			if (source.isNull())
+				break;
+			const int delay = reader.nextImageDelay();
+
+			const QImage prepared = MPixmapCache::prepareImage(source, m_key.size, m_key.maskMode, m_key.maskAnchor);
+			const QImage frame = MPixmapCache::renderImage(prepared, m_key.size, m_key.borderRadius);
+			if (!post("movieFrameDecoded", Q_ARG(int, m_ticket), Q_ARG(int, index), Q_ARG(int, delay), Q_ARG(QImage, frame)))
+				return;
+			++index;
+
+			if (!reader.supportsAnimation() || (reader.imageCount() > 0 && index >= reader.imageCount()))
+				break;
+		}
+		if (!*m_cancelled)
+			post("movieDecodeFinished", Q_ARG(int, m_ticket), Q_ARG(int, reader.loopCount()));
+	}
+
+private:
+	template <typename... Args>
+	bool post(const char * slot, Args... args)
+	{
+		QMutexLocker locker(&m_receiver->mutex);
+		if (!m_receiver->cache)
+			return false;
+		return QMetaObject::invokeMethod(m_receiver->cache, slot, Qt::QueuedConnection, args...);
+	}
+
+private:
+	std::shared_ptr<Receiver>          m_receiver;
+	std::shared_ptr<std::atomic<bool>> m_cancelled;
+	int             m_ticket;
+	MPixmapCacheKey m_key;
+};
+
+int pixmapBytes(const QPixmap & pixmap)
+{
+	return pixmap.width() * pixmap.height() * pixmap.depth() / 8;
+}
+
+} // namespace
+
+uint qHash(const MPixmapCacheKey & key, uint seed)
+{
+	return qHash(key.path, seed) ^ qHash(key.pixmapKey, seed) ^ qHash(key.size.width(), seed) ^ qHash(key.size.height() << 16, seed)
+		^ qHash((key.maskMode << 24) | (key.maskAnchor << 16) | key.borderRadius, seed);
+}
+
+struct MPixmapCache::Impl
+{
+	/// Изображение, которое готовится в пуле потоков, и виджеты, которые его ждут
+	struct Pending
+	{
+		MPixmapCacheKey key;
+		std::shared_ptr<std::atomic<bool>> cancelled;
+		QVector<QPointer<QWidget>> waiters;
+	};
+
+	/// Анимация, декодированная для одного ключа
+	struct Movie
+	{
+		MPixmapCacheKey key;
+		int ticket = 0;
+		std::shared_ptr<std::atomic<bool>> cancelled;
+
+		QVector<QPixmap> frames;
+		QVector<int>     delays;
+		int  bytes       = 0;
+		bool complete    = false; ///< все кадры декодированы
+		bool unavailable = false; ///< не декодируется или не помещается в movieLimit
+		int  loopCount   = -1;    ///< как у QImageReader: -1 - бесконечно
+
+		int    current     = 0;   ///< фаза воспроизведения; кадр может быть ещё не декодирован
+		int    loopsDone   = 0;
+		qint64 nextFrameAt = -1;  ///< момент смены текущего кадра по clock; -1 - воспроизведение стоит
+		int    wanted      = 0;   ///< кадр, который нужно показать, как только он будет декодирован; -1 - нет
+		quint64 lastUsed   = 0;
+
+		QVector<QPointer<QWidget>> subscribers;
+
+		int delay(int index) const { return qMax(delays[index], MIN_FRAME_DELAY); }
+
+		void notify() const
+		{
+			for (const QPointer<QWidget> & subscriber : subscribers)
+				if (subscriber)
+					subscriber->update();
+		}
+	};
+	using MoviePtr = std::shared_ptr<Movie>;
+
+	/// Число кадров и задержки анимации из файла; строится при первом полном декодировании и позволяет
+	/// сразу перейти к нужному кадру анимации того же файла с другими параметрами отрисовки
+	struct MovieIndex
+	{
+		QVector<int> delays;
+		int loopCount = -1;
+	};
+
+	Impl(MPixmapCache * cache)
+		: receiver(std::make_shared<Receiver>())
+	{
+		receiver->cache = cache;
+		pixmaps.setMaxCost(DEFAULT_CACHE_LIMIT);
+		moviePool.setMaxThreadCount(MOVIE_DECODE_THREADS);
+		unavailableMovies.setMaxCost(MAX_UNAVAILABLE_MOVIES);
+
+		clock.start();
+		movieTimer.setSingleShot(true);
+		movieTimer.setTimerType(Qt::PreciseTimer);
+		QObject::connect(&movieTimer, &QTimer::timeout, cache, &MPixmapCache::advanceMovies);
+	}
+
+	~Impl()
+	{
+		{
+			QMutexLocker locker(&receiver->mutex);
+			receiver->cache = nullptr;
+		}
+		cancelAll();
+	}
+
+	void cancelAll()
+	{
+		for (const Pending & request : pending)
+			*request.cancelled = true;
+		pending.clear();
+		tickets.clear();
+
+		for (const MoviePtr & movie : movies)
+		{
+			*movie->cancelled = true;
+			movie->notify();
+		}
+		movies.clear();
+		moviesByTicket.clear();
+		subscriptions.clear();
+		movieIndexes.clear();
+		unavailableMovies.clear();
+		movieBytes = 0;
+		movieTimer.stop();
+	}
+
+	Pending & addPending(const MPixmapCacheKey & key, QWidget * waiter)
+	{
+		const int ticket = nextTicket++;
+		Pending & request = pending[ticket];
+		request.key = key;
+		request.cancelled = std::make_shared<std::atomic<bool>>(false);
+		request.waiters.append(waiter);
+		tickets.insert(key, ticket);
+		return request;
+	}
+
+	void removeMovie(const MoviePtr & movie)
+	{
+		*movie->cancelled = true;
+		movieBytes -= movie->bytes;
+		movies.remove(movie->key);
+		moviesByTicket.remove(movie->ticket);
+	}
+
+	/// Освобождает место под новые кадры, вытесняя давно не использованные анимации без подписчиков
+	void evictMovies(const Movie * keep)
+	{
+		while (movieBytes > movieLimit)
+		{
+			MoviePtr oldest;
+			for (const MoviePtr & movie : movies)
+				if (movie.get() != keep && movie->subscribers.isEmpty() && movie->bytes > 0 && (!oldest || movie->lastUsed < oldest->lastUsed))
+					oldest = movie;
+			if (!oldest)
+				return;
+			removeMovie(oldest);
+		}
+	}
+
+	/// Сдвигает кадры анимации, время смены кадра которой уже наступило; возвращает true, если кадр сменился
+	bool advance(Movie & movie, qint64 now)
+	{
+		if (movie.nextFrameAt < 0 || movie.nextFrameAt > now)
+			return false;
+		if (now - movie.nextFrameAt > MAX_MOVIE_LAG)
+			movie.nextFrameAt = now;
+
+		const int previous = movie.current;
+		while (movie.nextFrameAt >= 0 && movie.nextFrameAt <= now)
+		{
+			int next = movie.current + 1;
+			if (next >= movie.frames.size())
+			{
+				if (!movie.complete)
+				{
+					movie.nextFrameAt = -1;
+					movie.wanted = next;
+					break;
+				}
+				next = 0;
+				if (movie.frames.size() < 2 || (movie.loopCount >= 0 && ++movie.loopsDone > movie.loopCount))
+				{
+					movie.nextFrameAt = -1;
+					break;
+				}
+			}
+			movie.current = next;
+			movie.nextFrameAt += movie.delay(next);
+		}
+		return movie.current != previous;
+	}
+
+	void scheduleMovies()
+	{
+		qint64 next = -1;
+		for (const MoviePtr & movie : movies)
+			if (!movie->subscribers.isEmpty() && movie->nextFrameAt >= 0 && (next < 0 || movie->nextFrameAt < next))
+				next = movie->nextFrameAt;
+
+		if (next < 0)
+		{
+			movieTimer.stop();
+			return;
+		}
+		movieTimer.start(int(qMax<qint64>(0, next - clock.elapsed())));
+	}
+
+	std::shared_ptr<Receiver>  receiver;
+	QCache<MPixmapCacheKey, QPixmap> pixmaps; ///< стоимость элемента - размер изображения в байтах
+	QHash<int, Pending>        pending;       ///< по номеру запроса
+	QHash<MPixmapCacheKey, int> tickets;      ///< номер запроса для ключа
+	int nextTicket = 0;
+
+	QHash<MPixmapCacheKey, MoviePtr> movies;
+	QHash<int, MoviePtr>             moviesByTicket;
+	QHash<QWidget *, MoviePtr>       subscriptions;
+	QHash<QString, MovieIndex>       movieIndexes; ///< по пути к файлу
+	QCache<MPixmapCacheKey, bool>    unavailableMovies; ///< ключи анимаций, удалённых как недоступные
+	int movieBytes = 0;
+	int movieLimit = DEFAULT_MOVIE_CACHE_LIMIT;
+	quint64 movieUse = 0;
+	QElapsedTimer clock;
+	QTimer        movieTimer; ///< общий для всех анимаций, срабатывает к ближайшей смене кадра
+	QThreadPool   moviePool;  ///< объявлен последним: при разрушении ждёт уже отменённые задачи
+};
+
+MPixmapCache * MPixmapCache::instance()
+{
+	static MPixmapCache cache;
+	return &cache;
+}
+
+MPixmapCache::MPixmapCache()
+	: m_impl(new Impl(this))
+{
+	// QPixmap нельзя разрушать после QGuiApplication, а кэш живёт до выгрузки библиотеки
+	if (QCoreApplication::instance())
+		connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, this, &MPixmapCache::clear);
+}
+
+MPixmapCache::~MPixmapCache() = default;
+
+int MPixmapCache::limit() const
+{
+	return m_impl->pixmaps.maxCost();
+}
+
+void MPixmapCache::setLimit(int bytes)
+{
+	m_impl->pixmaps.setMaxCost(bytes);
+}
+
+int MPixmapCache::size() const
+{
+	return m_impl->pixmaps.totalCost();
+}
+
+void MPixmapCache::clear()
+{
+	m_impl->cancelAll();
+	m_impl->pixmaps.clear();
+}
+
+const QPixmap * MPixmapCache::find(const MPixmapCacheKey & key)
+{
+	return m_impl->pixmaps.object(key);
+}
+
+QPixmap MPixmapCache::insert(const MPixmapCacheKey & key, const QImage & image)
+{
+	if (image.isNull())
+		return QPixmap();
+
+	QPixmap pixmap = QPixmap::fromImage(image);
+	pixmap.setDevicePixelRatio(1);
+
+	// изображение больше всего кэша QCache не примет, его держит только получивший его виджет
+	const int bytes = pixmapBytes(pixmap);
+	if (bytes <= m_impl->pixmaps.maxCost())
+		m_impl->pixmaps.insert(key, new QPixmap(pixmap), bytes);
+	return pixmap;
+}
+
+bool MPixmapCache::wait(const MPixmapCacheKey & key, QWidget * waiter)
+{
+	const auto ticket = m_impl->tickets.constFind(key);
+	if (ticket == m_impl->tickets.constEnd())
+		return false;
+
+	auto & waiters = m_impl->pending[*ticket].waiters;
+	if (!waiters.contains(waiter))
+		waiters.append(waiter);
+	return true;
+}
+
+void MPixmapCache::render(const MPixmapCacheKey & key, const QImage & prepared, QWidget * waiter)
+{
+	if (wait(key, waiter))
+		return;
+
+	const Impl::Pending & request = m_impl->addPending(key, waiter);
+	QThreadPool::globalInstance()->start(new RenderTask(m_impl->receiver, request.cancelled, m_impl->tickets.value(key), prepared, key.size, key.borderRadius));
+}
+
+void MPixmapCache::renderFile(const MPixmapCacheKey & key, QWidget * waiter)
+{
+	assert(!key.path.isEmpty());
+	if (wait(key, waiter))
+		return;
+
+	const Impl::Pending & request = m_impl->addPending(key, waiter);
+	QThreadPool::globalInstance()->start(new DecodeTask(m_impl->receiver, request.cancelled, m_impl->tickets.value(key), key));
+}
+
+void MPixmapCache::cancel(QWidget * waiter)
+{
+	for (auto it = m_impl->pending.begin(); it != m_impl->pending.end(); )
+	{
+		it->waiters.removeAll(waiter);
+		it->waiters.removeAll(nullptr);
+		if (!it->waiters.isEmpty())
+		{
+			++it;
+			continue;
+		}
+		*it->cancelled = true;
+		m_impl->tickets.remove(it->key);
+		it = m_impl->pending.erase(it);
+	}
+}
+
+void MPixmapCache::cancel(QWidget * waiter, const MPixmapCacheKey & key)
+{
+	const auto ticket = m_impl->tickets.constFind(key);
+	if (ticket == m_impl->tickets.constEnd())
+		return;
+
+	const auto it = m_impl->pending.find(*ticket);
+	it->waiters.removeAll(waiter);
+	it->waiters.removeAll(nullptr);
+	if (!it->waiters.isEmpty())
+		return;
+	*it->cancelled = true;
+	m_impl->tickets.remove(key);
+	m_impl->pending.erase(it);
+}
+
+int MPixmapCache::movieLimit() const
+{
+	return m_impl->movieLimit;
+}
+
+void MPixmapCache::setMovieLimit(int bytes)
+{
+	m_impl->movieLimit = bytes;
+	m_impl->unavailableMovies.clear(); // в новый объём они могут и поместиться
+	m_impl->evictMovies(nullptr);
+}
+
+int MPixmapCache::movieSize() const
+{
+	return m_impl->movieBytes;
+}
+
+void MPixmapCache::subscribeMovie(const MPixmapCacheKey & key, QWidget * subscriber, int startFrame)
+{
+	const auto subscription = m_impl->subscriptions.constFind(subscriber);
+	if (subscription != m_impl->subscriptions.constEnd())
+	{
+		if ((*subscription)->key == key)
+			return;
+		if (startFrame < 0)
+			startFrame = (*subscription)->current; // при смене размера фаза сохраняется
+	}
+	unsubscribeMovie(subscriber);
+	startFrame = qMax(0, startFrame);
+
+	const auto index = m_impl->movieIndexes.constFind(key.path);
+	if (index != m_impl->movieIndexes.constEnd() && !index->delays.isEmpty())
+		startFrame %= index->delays.size();
+
+	Impl::MoviePtr & movie = m_impl->movies[key];
+	if (!movie)
+	{
+		movie = std::make_shared<Impl::Movie>();
+		movie->key       = key;
+		movie->ticket    = m_impl->nextTicket++;
+		movie->cancelled = std::make_shared<std::atomic<bool>>(false);
+		movie->current   = startFrame;
+		movie->wanted    = startFrame;
+		m_impl->moviesByTicket.insert(movie->ticket, movie);
+		if (m_impl->unavailableMovies.contains(key))
+			movie->unavailable = true;
+		else
+			m_impl->moviePool.start(new MovieDecodeTask(m_impl->receiver, movie->cancelled, movie->ticket, key));
+	}
+	else if (movie->subscribers.isEmpty() && movie->complete && !movie->frames.isEmpty())
+	{
+		// все кадры уже декодированы: переход к нужному кадру - просто индекс
+		movie->current     = startFrame % movie->frames.size();
+		movie->wanted      = -1;
+		movie->loopsDone   = 0;
+		movie->nextFrameAt = m_impl->clock.elapsed() + movie->delay(movie->current);
+	}
+
+	movie->subscribers.append(subscriber);
+	movie->lastUsed = ++m_impl->movieUse;
+	m_impl->subscriptions.insert(subscriber, movie);
+	m_impl->scheduleMovies();
+}
+
+void MPixmapCache::unsubscribeMovie(QWidget * subscriber)
+{
+	const Impl::MoviePtr movie = m_impl->subscriptions.take(subscriber);
+	if (!movie)
+		return;
+
+	movie->subscribers.removeAll(subscriber);
+	movie->subscribers.removeAll(nullptr);
+	if (!movie->subscribers.isEmpty())
+		return;
+	if (movie->unavailable)
+	{
+		// кадров у неё нет, а вытеснение по объёму её бы не тронуло; запоминаем только ключ
+		m_impl->unavailableMovies.insert(movie->key, new bool(true));
+		m_impl->removeMovie(movie);
+	}
+	else if (!movie->complete)
+		m_impl->removeMovie(movie); // недодекодированная анимация без подписчиков никому не нужна
+}
+
+int MPixmapCache::movieFrameNumber(QWidget * subscriber) const
+{
+	const Impl::MoviePtr movie = m_impl->subscriptions.value(subscriber);
+	return movie ? movie->current : -1;
+}
+
+QPixmap MPixmapCache::movieFrame(QWidget * subscriber) const
+{
+	const Impl::MoviePtr movie = m_impl->subscriptions.value(subscriber);
+	if (!movie || movie->current >= movie->frames.size())
+		return QPixmap();
+	return movie->frames[movie->current];
+}
+
+bool MPixmapCache::isMovieUnavailable(QWidget * subscriber) const
+{
+	const Impl::MoviePtr movie = m_impl->subscriptions.value(subscriber);
+	return movie && movie->unavailable;
+}
+
+QRect MPixmapCache::maskRect(const QSize & source, const QSize & size, int maskAnchor)
+{
+	if (source.isEmpty() || size.isEmpty())
+		return QRect(QPoint(0, 0), source);
+
+	const QSize preparedSize = [&size, &source]{
+		const qreal sourceWidth = static_cast<qreal>(source.width());
+		const qreal sourceHeight = static_cast<qreal>(source.height());
+		const qreal aspectRatio = static_cast<qreal>(size.width()) / static_cast<qreal>(size.height());
+		if(sourceWidth / aspectRatio > sourceHeight)
+			return QSizeF(sourceHeight * aspectRatio, sourceHeight).toSize();
+		else
+			return QSizeF(sourceWidth, sourceWidth / aspectRatio).toSize();
+	}();
+
+	const QRect sourceRect = QRect(QPoint(0, 0), source);
+	const QRect preparedRect = QRect(QPoint(0, 0), preparedSize);
+	QPoint topLeft;
+	switch(maskAnchor)
+	{
+	case MPixmapWidget::ANCHOR_CENTER:
+		topLeft = sourceRect.center() - preparedRect.center();
+		break;
+	case MPixmapWidget::ANCHOR_TOP_LEFT:
+		topLeft = sourceRect.topLeft();
+		break;
+	case MPixmapWidget::ANCHOR_TOP_RIGHT:
+		topLeft = sourceRect.topRight() - preparedRect.topRight();
+		break;
+	case MPixmapWidget::ANCHOR_BOTTOM_LEFT:
+		topLeft = sourceRect.bottomLeft() - preparedRect.bottomLeft();
+		break;
+	case MPixmapWidget::ANCHOR_BOTTOM_RIGHT:
+		topLeft = sourceRect.bottomRight() - preparedRect.bottomRight();
+		break;
+	}
+	return QRect(topLeft, preparedSize);
+}
+
+QImage MPixmapCache::decodeImage(const QString & path, const QSize & size, int maskMode, int maskAnchor)
+{
+	QImageReader reader(path);
+	const QSize sourceSize = reader.size();
+	if (!sourceSize.isValid() || size.isEmpty())
+		return reader.read(); // формат не сообщает размер заранее: декодируем целиком
+
+	const QRect clipRect = maskMode == MPixmapWidget::MASK_NONE
+		? QRect(QPoint(0, 0), sourceSize)
+		: maskRect(sourceSize, size, maskAnchor);
+	// уменьшаем, но не увеличиваем: растянуть при отрисовке дешевле, чем хранить лишние пиксели
+	const QSize scaledSize = clipRect.size().boundedTo(size);
+
+	if (clipRect.size() != sourceSize)
+		reader.setClipRect(clipRect);
+	if (scaledSize != clipRect.size())
+		reader.setScaledSize(scaledSize);
+	return reader.read();
+}
+
+QImage MPixmapCache::prepareImage(const QImage & source, const QSize & size, int maskMode, int maskAnchor)
+{
+	if (source.isNull() || size.isEmpty() || maskMode == MPixmapWidget::MASK_NONE)
+		return source;
+
+	const QRect preparedRect = maskRect(source.size(), size, maskAnchor);
+	const QSize preparedSize = preparedRect.size();
+
+	QImage rectangleImage = source.copy(preparedRect);
+	if(maskMode == MPixmapWidget::MASK_RECTANGLE)
+		return rectangleImage;
+
+	QImage ellipseImage(preparedSize, QImage::Format_ARGB32_Premultiplied);
+	ellipseImage.fill(Qt::transparent);
+	QPainter ellipsePainter(&ellipseImage);
+	ellipsePainter.setRenderHints(ellipsePainter.renderHints() | RENDER_HINTS);
+	ellipsePainter.setBrush(QBrush(rectangleImage));
+	ellipsePainter.setPen(Qt::NoPen);
+	ellipsePainter.drawEllipse(ellipseImage.rect());
+	ellipsePainter.end();
+
+	assert(maskMode == MPixmapWidget::MASK_ELLIPSE);
+	return ellipseImage;
+}
+
+QImage MPixmapCache::renderImage(const QImage & prepared, const QSize & size, int radius)
+{
+	QImage scaled = prepared.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+	if (radius <= 0 || scaled.isNull())
+		return scaled;
+
+	QImage rounded(size, QImage::Format_ARGB32_Premultiplied);
+	rounded.fill(Qt::transparent);
+	QPainter painter(&rounded);
+	painter.setRenderHints(painter.renderHints() | RENDER_HINTS);
+	painter.setBrush(QBrush(scaled));
+	painter.setPen(Qt::NoPen);
+	painter.drawRoundedRect(rounded.rect(), radius, radius);
+	painter.end();
+	return rounded;
+}
+
+void MPixmapCache::renderFinished(int ticket, const QImage & image)
+{
+	const auto it = m_impl->pending.find(ticket);
+	if (it == m_impl->pending.end())
+		return; // запрос отменён
+
+	const Impl::Pending request = *it;
+	m_impl->pending.erase(it);
+	m_impl->tickets.remove(request.key);
+
+	// результат передаётся ожидавшим виджетам напрямую: кэш мог его и не принять или уже вытеснить
+	const QPixmap pixmap = insert(request.key, image);
+	for (const QPointer<QWidget> & waiter : request.waiters)
+		if (auto pixmapWidget = qobject_cast<MPixmapWidget *>(waiter.data()))
+			pixmapWidget->renderFinished(request.key, pixmap);
+		else if (waiter)
+			waiter->update();
+}
+
+void MPixmapCache::movieFrameDecoded(int ticket, int index, int delay, const QImage & image)
+{
+	const Impl::MoviePtr movie = m_impl->moviesByTicket.value(ticket);
+	if (!movie || movie->unavailable || index != movie->frames.size())
+		return;
+
+	QPixmap frame = QPixmap::fromImage(image);
+	frame.setDevicePixelRatio(1);
+	const int bytes = pixmapBytes(frame);
+
+	m_impl->movieBytes += bytes;
+	m_impl->evictMovies(movie.get());
+	if (m_impl->movieBytes > m_impl->movieLimit)
+	{
+		// анимация не помещается в кэш целиком: подписчики проиграют её сами
+		m_impl->movieBytes -= bytes + movie->bytes;
+		*movie->cancelled = true;
+		movie->frames.clear();
+		movie->delays.clear();
+		movie->bytes = 0;
+		movie->unavailable = true;
+		movie->nextFrameAt = -1;
+		movie->notify();
+		return;
+	}
+
+	movie->frames.append(frame);
+	movie->delays.append(delay);
+	movie->bytes += bytes;
+
+	if (index != movie->wanted)
+		return;
+
+	// ждали именно этот кадр: показываем его сразу
+	movie->wanted  = -1;
+	movie->current = index;
+	movie->nextFrameAt = m_impl->clock.elapsed() + movie->delay(index);
+	movie->notify();
+	m_impl->scheduleMovies();
+}
+
+void MPixmapCache::movieDecodeFinished(int ticket, int loopCount)
+{
+	const Impl::MoviePtr movie = m_impl->moviesByTicket.value(ticket);
+	if (!movie || movie->unavailable)
+		return;
+
+	movie->complete  = true;
+	movie->loopCount = loopCount;
+	if (movie->frames.isEmpty())
+	{
+		movie->unavailable = true;
+		movie->notify();
+		return;
+	}
+
+	Impl::MovieIndex & index = m_impl->movieIndexes[movie->key.path];
+	index.delays    = movie->delays;
+	index.loopCount = loopCount;
+
+	if (movie->wanted < 0)
+		return;
+
+	// файл кончился раньше, чем появился нужный кадр: либо цикл закончился, либо начальная фаза
+	// была взята у анимации с большим числом кадров
+	const bool loopEnded = movie->wanted == movie->frames.size();
+	movie->current = movie->wanted % movie->frames.size();
+	movie->wanted  = -1;
+	if (loopEnded && loopCount >= 0 && ++movie->loopsDone > loopCount)
+		return;
+
+	movie->nextFrameAt = m_impl->clock.elapsed() + movie->delay(movie->current);
+	movie->notify();
+	m_impl->scheduleMovies();
+}
+
+void MPixmapCache::advanceMovies()
+{
+	const qint64 now = m_impl->clock.elapsed();
+	for (const Impl::MoviePtr & movie : m_impl->movies)
+		if (!movie->subscribers.isEmpty() && m_impl->advance(*movie, now))
+			movie->notify();
+	m_impl->scheduleMovies();
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <QImage>
+#include <QObject>
+#include <QPixmap>
+#include <QRect>
+#include <QScopedPointer>
+#include <QSize>
+#include <QString>
+
+#include "MovaviWidgetLib.h"
+
+class QWidget;
+
+/// @brief Параметры, полностью определяющие итоговое изображение MPixmapWidget
+struct MOVAVIWIDGET_API MPixmapCacheKey
+{
+	QString path;             ///< путь к файлу, если изображение загружено из файла
+	qint64  pixmapKey    = 0; ///< QPixmap::cacheKey() исходного изображения, если оно задано напрямую
+	QSize   size;             ///< размер результата в физических пикселях
+	int     maskMode     = 0;
+	int     maskAnchor   = 0;
+	int     borderRadius = 0; ///< в физических пикселях
+
+	bool isNull() const { return path.isEmpty() && pixmapKey == 0; }
+
+	bool operator==(const MPixmapCacheKey & other) const
+	{
+		return pixmapKey == other.pixmapKey && size == other.size && maskMode == other.maskMode
+			&& maskAnchor == other.maskAnchor && borderRadius == other.borderRadius && path == other.path;
+	}
+	bool operator!=(const MPixmapCacheKey & other) const { return !(*this == other); }
+};
+
+MOVAVIWIDGET_API uint qHash(const MPixmapCacheKey & key, uint seed = 0);
+
+/// @class MPixmapCache
+/// @brief Общий для всех MPixmapWidget кэш готовых (масштабированных и обрезанных маской) изображений
+/// @details Одинаковые виджеты (иконки и аватары в строках списков, сетках) разделяют один результат:
+/// ключ - источник (путь к файлу или cacheKey() исходного QPixmap) плюс параметры отрисовки.
+/// Объём ограничен limit() байтами, давно не использованные изображения вытесняются.
+/// Качественное масштабирование выполняется в пуле потоков, причём один раз на ключ:
+/// виджеты, запросившие уже готовящееся изображение, просто ждут его вместе с первым.
+///
+/// Анимации из файлов (moviePath) декодируются в пуле потоков один раз на ключ (путь, размер, маска):
+/// каждый кадр сразу масштабируется и обрезается маской, а воспроизведение всех анимаций идёт
+/// по индексу кадра от одного общего таймера. Декодированные кадры ограничены movieLimit() байтами;
+/// анимация, не помещающаяся в этот объём, помечается недоступной, и виджет проигрывает её сам через QMovie.
+/// @note Кэш, как и QPixmap, используется только из GUI-потока.
+class MOVAVIWIDGET_API MPixmapCache : public QObject
+{
+	Q_OBJECT
+
+public:
+	static MPixmapCache * instance();
+
+	int limit() const;
+	void setLimit(int bytes); ///< максимальный объём кэша в байтах
+	int  size() const;        ///< текущий объём кэша в байтах
+	void clear();
+
+	/// @brief Готовое изображение для @a key или nullptr; найденное изображение становится самым свежим
+	const QPixmap * find(const MPixmapCacheKey & key);
+	/// @brief Переводит @a image в QPixmap и кладёт его в кэш, если оно не больше limit()
+	/// @details Кэш только разделяет результат между виджетами и вытесняет его: текущее изображение
+	/// виджет держит сам, поэтому вытеснение или слишком большое изображение не приводят к повторной отрисовке.
+	QPixmap insert(const MPixmapCacheKey & key, const QImage & image);
+
+	/// @brief Если изображение для @a key уже готовится, запоминает @a waiter и возвращает true
+	bool wait(const MPixmapCacheKey & key, QWidget * waiter);
+	/// @brief Запускает в пуле потоков масштабирование @a prepared до key.size со скруглением углов key.borderRadius;
+	/// по готовности результат попадает в кэш и передаётся всем ожидающим виджетам
+	void render(const MPixmapCacheKey & key, const QImage & prepared, QWidget * waiter);
+	/// @brief Запускает в пуле потоков декодирование файла key.path через decodeImage()
+	/// @details В кэш попадает только декодированное изображение: маску-эллипс и скругление углов
+	/// виджет накладывает сам при подготовке итогового изображения, поэтому в @a key они не задаются.
+	void renderFile(const MPixmapCacheKey & key, QWidget * waiter);
+	/// @brief Снимает @a waiter со всех ожиданий; запросы, которые больше никто не ждёт, отменяются
+	void cancel(QWidget * waiter);
+	/// @brief Снимает @a waiter с ожидания изображения для @a key
+	void cancel(QWidget * waiter, const MPixmapCacheKey & key);
+
+	int movieLimit() const;
+	void setMovieLimit(int bytes); ///< максимальный объём декодированных кадров анимаций в байтах
+	int  movieSize() const;        ///< текущий объём декодированных кадров анимаций в байтах
+
+	/// @brief Подписывает @a subscriber на анимацию из файла key.path с параметрами отрисовки из @a key
+	/// @details Повторная подписка с тем же ключом ничего не стоит; подписка с другим ключом заменяет прежнюю.
+	/// При смене кадра подписчики перерисовываются. Воспроизведение начинается с кадра @a startFrame
+	/// (-1 - с кадра прежней подписки), если только у анимации уже нет других подписчиков: тогда
+	/// подписчик присоединяется к их фазе. Переход к кадру не требует декодирования пропущенных кадров,
+	/// если они уже в кэше; иначе до его декодирования movieFrame() возвращает пустой QPixmap.
+	void subscribeMovie(const MPixmapCacheKey & key, QWidget * subscriber, int startFrame = -1);
+	void unsubscribeMovie(QWidget * subscriber);
+	/// @brief Номер текущего кадра анимации @a subscriber или -1, если он не подписан
+	int movieFrameNumber(QWidget * subscriber) const;
+	/// @brief Текущий кадр анимации @a subscriber или пустой QPixmap, если он ещё не декодирован
+	QPixmap movieFrame(QWidget * subscriber) const;
+	/// @brief Анимацию @a subscriber не удалось декодировать или она не поместилась в movieLimit()
+	bool isMovieUnavailable(QWidget * subscriber) const;
+
+	/// @brief Часть изображения размера @a source, которую оставляет маска с пропорциями @a size и привязкой @a maskAnchor
+	static QRect maskRect(const QSize & source, const QSize & size, int maskAnchor);
+	/// @brief Декодирует файл @a path сразу обрезанным маской (QImageReader::setClipRect) и уменьшенным
+	/// не больше чем до @a size (QImageReader::setScaledSize), так что ни память, ни время декодирования
+	/// не зависят от разрешения исходного файла. Изображение меньше @a size не увеличивается.
+	static QImage decodeImage(const QString & path, const QSize & size, int maskMode, int maskAnchor);
+	/// @brief Обрезает @a source маской @a maskMode по пропорциям @a size, учитывая @a maskAnchor
+	static QImage prepareImage(const QImage & source, const QSize & size, int maskMode, int maskAnchor);
+	/// @brief Качественно масштабирует @a prepared до @a size и запекает скругление углов @a radius в альфа-канал
+	static QImage renderImage(const QImage & prepared, const QSize & size, int radius);
+
+private slots:
+	void renderFinished(int ticket, const QImage & image);
+	void movieFrameDecoded(int ticket, int index, int delay, const QImage & image);
+	void movieDecodeFinished(int ticket, int loopCount);
+	void advanceMovies();
+
+private:
+	MPixmapCache();
+	~MPixmapCache();
+
+private:
+	struct Impl;
+	QScopedPointer<Impl> m_impl;
+};
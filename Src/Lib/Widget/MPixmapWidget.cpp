@@ -1,7 +1,5 @@
 #include "MPixmapWidget.h"
 
-#include <cassert>
-
 #include <QMovie>
 #include <QPixmap>
 #include <QPointer>
@@ -9,10 +7,38 @@
 #include <QPaintEvent>
 #include <QBackingStore>
 
+#include "MPixmapCache.h"
+
 namespace {
 
 const QPainter::RenderHints RENDER_HINTS = QPainter::Antialiasing | QPainter::HighQualityAntialiasing | QPainter::SmoothPixmapTransform;
 
+/// Изображения не больше этого числа пикселей масштабируются сразу: задача пула обошлась бы дороже
+const int SYNC_SCALE_MAX_PIXELS = 128 * 128;
+
+/// Допустимое относительное расхождение пропорций виджета и декодированного под маску изображения
+const qreal MAX_ASPECT_RATIO_ERROR = 0.01;
+
+/// Подготовленное (обрезанное маской) изображение от скругления углов не зависит
+bool samePrepared(const MPixmapCacheKey & a, const MPixmapCacheKey & b)
+{
+	return a.pixmapKey == b.pixmapKey && a.size == b.size && a.maskMode == b.maskMode && a.maskAnchor == b.maskAnchor && a.path == b.path;
+}
+
+/// Быстрое масштабирование на время, пока качественное изображение не готово
+void drawPreview(QPainter & painter, const QRect & rect, const QPixmap & pixmap, int radius)
+{
+	painter.setRenderHints(painter.renderHints() | RENDER_HINTS);
+	painter.setRenderHint(QPainter::SmoothPixmapTransform, false);
+	if (radius)
+	{
+		QPainterPath clipPath;
+		clipPath.addRoundedRect(rect, radius, radius);
+		painter.setClipPath(clipPath);
+	}
+	painter.drawPixmap(rect, pixmap, pixmap.rect());
+}
+
 } // namespace
 
 struct MPixmapWidget::Impl : public QObject
@@ -21,8 +47,15 @@ struct MPixmapWidget::Impl : public QObject
 		: pixmapWidget(pixmapWidget)
 	{ }
 
+	~Impl()
+	{
+		MPixmapCache::instance()->cancel(pixmapWidget);
+		MPixmapCache::instance()->unsubscribeMovie(pixmapWidget);
+	}
+
 	void initMovie(QMovie * movie)
 	{
+		stopSharedMovie();
 		if (this->movie)
 			disconnect(this->movie.data(), &QMovie::frameChanged, this, &Impl::update);
 		this->movie = movie;
@@ -32,122 +65,295 @@ struct MPixmapWidget::Impl : public QObject
 		update();
 	}
 
+	/// Анимация из файла проигрывается из общего кэша кадров MPixmapCache, собственный QMovie нужен,
+	/// только если анимация туда не поместилась
 	void initMovie(const QString & path)
 	{
-		ownedMoviePath = path;
 		// Try to keep the same frame
+		const int frameNumber = movieFrameNumber();
+
+		ownedMoviePath = path;
+		if (ownedMovie)
+			ownedMovie->stop();
+		initMovie(nullptr);
+		sharedMovie = !path.isEmpty();
+		sharedMovieStartFrame = frameNumber != -1 ? frameNumber + 1 : 0;
+	}
+
+	int movieFrameNumber() const
+	{
+		if (sharedMovie)
+		{
+			// скрытый виджет не подписан, его фаза запомнена в sharedMovieStartFrame
+			const int frameNumber = MPixmapCache::instance()->movieFrameNumber(pixmapWidget);
+			return frameNumber != -1 ? frameNumber : sharedMovieStartFrame;
+		}
+		return movie ? movie->currentFrameNumber() : -1;
+	}
+
+	void stopSharedMovie()
+	{
+		MPixmapCache::instance()->unsubscribeMovie(pixmapWidget);
+		sharedMovie = false;
+		sharedMovieFrame = QPixmap();
+	}
+
+	/// Текущий кадр анимации из общего кэша; если кэш не может её проиграть, переключается на собственный QMovie
+	QPixmap currentSharedMovieFrame()
+	{
+		MPixmapCache * cache = MPixmapCache::instance();
+		MPixmapCacheKey key = renderKey();
+		key.path      = ownedMoviePath;
+		key.pixmapKey = 0;
+		cache->subscribeMovie(key, pixmapWidget, sharedMovieStartFrame);
+		sharedMovieStartFrame = -1;
+
+		if (cache->isMovieUnavailable(pixmapWidget))
+		{
+			initOwnedMovie(ownedMoviePath);
+			return QPixmap();
+		}
+
+		// пока кадр для нового размера не декодирован, показываем последний полученный
+		const QPixmap frame = cache->movieFrame(pixmapWidget);
+		if (!frame.isNull())
+			sharedMovieFrame = frame;
+		return sharedMovieFrame;
+	}
+
+	/// @note Фаза здесь не восстанавливается: QMovie умеет перейти к кадру гифки, только декодировав в GUI-потоке
+	/// все предыдущие, а сюда попадают как раз анимации, слишком большие для общего кэша кадров.
+	void initOwnedMovie(const QString & path)
+	{
 		if (!ownedMovie)
 			ownedMovie = new QMovie(pixmapWidget);
-		int frameNumber = ownedMovie->currentFrameNumber();
 		ownedMovie->stop();
 		ownedMovie->setFileName(path);
 		initMovie(ownedMovie);
 		ownedMovie->start();
-		if (frameNumber != -1 && ownedMovie->frameCount() > 0)
-		{
-			frameNumber = (frameNumber + 1) % ownedMovie->frameCount();
-			/// XXX: QMovie::jumpToFrame не работает в некоторых ситуациях, например,
-			/// если movie только что загрузил файл и ещё не проиграл весь цикл фреймов
-			while (ownedMovie->currentFrameNumber() != frameNumber)
-				ownedMovie->jumpToNextFrame();
-		}
 	}
 
 	void update()
 	{
-		preparePixmap();
+		// кадр запоминается один раз: у каждого вызова QMovie::currentPixmap() свой cacheKey()
+		moviePixmap = movie ? movie->currentPixmap() : QPixmap();
 		pixmapWidget->update();
 	}
 
-	void preparePixmap()
+	const QPixmap & sourcePixmap() const
 	{
-		scaledPixmap = QPixmap();
+		if (movie)
+			return moviePixmap;
+		return imagePath.isEmpty() ? originalPixmap : decodedPixmap;
+	}
 
-		QPixmap pixmap = movie
-			? movie->currentPixmap()
-			: originalPixmap;
+	QSize deviceSize() const
+	{
+		return (QSizeF(pixmapWidget->size()) * pixmapWidget->devicePixelRatioF()).toSize();
+	}
 
-		pixmap.setDevicePixelRatio(1);
+	MPixmapCacheKey renderKey() const
+	{
+		MPixmapCacheKey key;
+		key.pixmapKey    = sourcePixmap().cacheKey();
+		key.size         = deviceSize();
+		key.maskMode     = maskMode;
+		key.maskAnchor   = maskAnchor;
+		key.borderRadius = qRound(borderRadius * pixmapWidget->devicePixelRatioF());
+		return key;
+	}
 
-		if(pixmap.isNull() || maskMode == MASK_NONE)
+	/// Обеспечивает декодированное из imagePath изображение, достаточное для размера @a size в физических пикселях.
+	/// Файл декодируется сразу уменьшенным и обрезанным прямоугольной маской, а эллипс и скругление накладываются
+	/// уже на результат. Возвращает false, пока подходящее изображение декодируется.
+	bool ensureDecoded(const QSize & size)
+	{
+		if (size.isEmpty())
+			return false; // иначе файл декодировался бы в полном разрешении
+
+		MPixmapCacheKey key;
+		key.path       = imagePath;
+		key.size       = size;
+		key.maskMode   = maskMode == MASK_ELLIPSE ? MASK_RECTANGLE : maskMode;
+		key.maskAnchor = maskAnchor;
+
+		MPixmapCache * cache = MPixmapCache::instance();
+		if (decodedPixmap.isNull() && decodedKey == key)
+			return false; // файл не декодируется, повторять для того же размера бессмысленно
+		if (!decodedCovers(key))
 		{
-			preparedPixmap = pixmap;
-			return;
-		}
-
-		const QSize preparedSize = [this, &pixmap]{
-			const qreal pixmapWidth = static_cast<qreal>(pixmap.width());
-			const qreal pixmapHeight = static_cast<qreal>(pixmap.height());
-			const qreal aspectRatio = static_cast<qreal>(pixmapWidget->width()) / static_cast<qreal>(pixmapWidget->height());
-			if(pixmapWidth / aspectRatio > pixmapHeight)
-				return QSizeF(pixmapHeight * aspectRatio, pixmapHeight).toSize();
-			else
-				return QSizeF(pixmapWidth, pixmapWidth / aspectRatio).toSize();
-		}();
-
-		const QRect preparedRect = [this, &preparedSize, &pixmap]{
-			const QRect originalPixmapRect = pixmap.rect();
-			const QRect preparedPixmapRect = QRect(QPoint(0, 0), preparedSize);
-			QPoint topLeft;
-			switch(maskAnchor)
+			const QPixmap * pixmap = cache->find(key);
+			if (!pixmap)
 			{
-			case ANCHOR_CENTER:
-				topLeft = originalPixmapRect.center() - preparedPixmapRect.center();
-				break;
-			case ANCHOR_TOP_LEFT:
-				topLeft = originalPixmapRect.topLeft();
-				break;
-			case ANCHOR_TOP_RIGHT:
-				topLeft = originalPixmapRect.topRight() - preparedPixmapRect.topRight();
-				break;
-			case ANCHOR_BOTTOM_LEFT:
-				topLeft = originalPixmapRect.bottomLeft() - preparedPixmapRect.bottomLeft();
-				break;
-			case ANCHOR_BOTTOM_RIGHT:
-				topLeft = originalPixmapRect.bottomRight() - preparedPixmapRect.bottomRight();
-				break;
+				if (!pendingDecodeKey.isNull() && pendingDecodeKey != key)
+					cache->cancel(pixmapWidget, pendingDecodeKey);
+				pendingDecodeKey = key;
+				if (!cache->wait(key, pixmapWidget))
+					cache->renderFile(key, pixmapWidget);
+				return false;
 			}
-			return QRect(topLeft, preparedSize);
-		}();
-
-		QPixmap rectanglePixmap(preparedSize);
-		rectanglePixmap.setDevicePixelRatio(1);
-		rectanglePixmap.fill(Qt::transparent);
-		QPainter rectanglePainter(&rectanglePixmap);
-		rectanglePainter.setRenderHints(rectanglePainter.renderHints() | RENDER_HINTS);
-		rectanglePainter.drawPixmap(rectanglePixmap.rect(), pixmap, preparedRect);
-		rectanglePainter.end();
-
-		if(maskMode == MASK_RECTANGLE)
+			decodedPixmap = *pixmap;
+			decodedKey    = key;
+		}
+
+		if (!pendingDecodeKey.isNull())
+			cache->cancel(pixmapWidget, pendingDecodeKey);
+		pendingDecodeKey = MPixmapCacheKey();
+		return true;
+	}
+
+	/// Уменьшение виджета не требует повторного декодирования, увеличение - только сверх декодированного размера
+	bool decodedCovers(const MPixmapCacheKey & key) const
+	{
+		if (decodedPixmap.isNull() || decodedKey.path != key.path
+			|| decodedKey.maskMode != key.maskMode || decodedKey.maskAnchor != key.maskAnchor)
+			return false;
+
+		// изображение меньше запрошенного значит, что файл декодирован в полном разрешении
+		const QSize decodedSize = decodedPixmap.size();
+		const bool widthCovered  = key.size.width()  <= decodedKey.size.width()  || decodedSize.width()  < decodedKey.size.width();
+		const bool heightCovered = key.size.height() <= decodedKey.size.height() || decodedSize.height() < decodedKey.size.height();
+		if (!widthCovered || !heightCovered)
+			return false;
+		if (key.maskMode == MASK_NONE || key.size.isEmpty())
+			return true;
+
+		// маска вырезает часть файла по пропорциям виджета: при их заметном изменении нужна другая часть
+		const qreal aspectRatio        = static_cast<qreal>(key.size.width()) / key.size.height();
+		const qreal decodedAspectRatio = static_cast<qreal>(decodedSize.width()) / decodedSize.height();
+		return qAbs(aspectRatio - decodedAspectRatio) <= aspectRatio * MAX_ASPECT_RATIO_ERROR;
+	}
+
+	void resetDecoded()
+	{
+		if (!pendingDecodeKey.isNull())
+			MPixmapCache::instance()->cancel(pixmapWidget, pendingDecodeKey);
+		pendingDecodeKey = MPixmapCacheKey();
+		decodedPixmap    = QPixmap();
+		decodedKey       = MPixmapCacheKey();
+	}
+
+	/// Возвращает готовое изображение для @a key или, если его ещё нет, запускает его подготовку и возвращает nullptr
+	const QPixmap * ensureRendered(const MPixmapCacheKey & key)
+	{
+		MPixmapCache * cache = MPixmapCache::instance();
+		if (!pendingKey.isNull() && key != pendingKey)
 		{
-			preparedPixmap = rectanglePixmap;
-			return;
+			// запрос для прежних параметров больше не нужен этому виджету
+			cache->cancel(pixmapWidget, pendingKey);
+			pendingKey = MPixmapCacheKey();
+		}
+
+		// декодированное точно под размер виджета изображение без эллипса и скругления уже готово к отрисовке
+		if (!movie && !imagePath.isEmpty() && decodedPixmap.size() == key.size
+			&& maskMode != MASK_ELLIPSE && key.borderRadius == 0)
+			return &decodedPixmap;
+
+		if (!renderedPixmap.isNull() && renderedKey == key)
+			return &renderedPixmap;
+		renderedPixmap = QPixmap();
+		renderedKey    = MPixmapCacheKey();
+
+		if (movie)
+		{
+			// у каждого кадра QMovie свой cacheKey(), и ключ больше не повторится: в общем кэше такие кадры
+			// только вытесняли бы разделяемые изображения, поэтому кадр готовится сразу и хранится лишь в виджете
+			preparePixmap(key);
+			if (preparedPixmap.isNull())
+				return nullptr;
+			QPixmap frame = QPixmap::fromImage(MPixmapCache::renderImage(preparedPixmap.toImage(), key.size, key.borderRadius));
+			frame.setDevicePixelRatio(1);
+			setRendered(key, frame);
+			return &renderedPixmap;
 		}
 
-		QPixmap ellipsePixmap(preparedSize);
-		ellipsePixmap.setDevicePixelRatio(1);
-		ellipsePixmap.fill(Qt::transparent);
-		QPainter ellipsePainter(&ellipsePixmap);
-		ellipsePainter.setRenderHints(ellipsePainter.renderHints() | RENDER_HINTS);
-		ellipsePainter.setBrush(QBrush(rectanglePixmap));
-		ellipsePainter.setPen(Qt::NoPen);
-		ellipsePainter.drawEllipse(rectanglePixmap.rect());
-		ellipsePainter.end();
-
-		assert(maskMode == MASK_ELLIPSE);
-		preparedPixmap = ellipsePixmap;
+		if (const QPixmap * pixmap = cache->find(key))
+		{
+			setRendered(key, *pixmap);
+			return &renderedPixmap;
+		}
+
+		preparePixmap(key);
+		if (preparedPixmap.isNull())
+			return nullptr;
+
+		if (qint64(key.size.width()) * key.size.height() <= SYNC_SCALE_MAX_PIXELS
+			|| qint64(preparedPixmap.width()) * preparedPixmap.height() <= SYNC_SCALE_MAX_PIXELS)
+		{
+			setRendered(key, cache->insert(key, MPixmapCache::renderImage(preparedPixmap.toImage(), key.size, key.borderRadius)));
+			return &renderedPixmap;
+		}
+
+		// изображение может уже готовиться по запросу другого виджета с тем же источником
+		pendingKey = key;
+		if (!cache->wait(key, pixmapWidget))
+			cache->render(key, preparedPixmap.toImage(), pixmapWidget);
+		return nullptr;
+	}
+
+	/// Запоминает готовое изображение: копия QPixmap разделяет данные с общим кэшем и переживает вытеснение из него
+	void setRendered(const MPixmapCacheKey & key, const QPixmap & pixmap)
+	{
+		renderedPixmap = pixmap;
+		renderedKey    = key;
+		// собственная копия подготовленного изображения больше не нужна
+		releasePrepared();
+	}
+
+	/// Результат запроса к MPixmapCache, которого ждал виджет
+	void renderFinished(const MPixmapCacheKey & key, const QPixmap & pixmap)
+	{
+		if (key == pendingDecodeKey)
+		{
+			pendingDecodeKey = MPixmapCacheKey();
+			decodedPixmap    = pixmap;
+			decodedKey       = key;
+		}
+		if (key == pendingKey)
+			setRendered(key, pixmap);
+		pixmapWidget->update();
+	}
+
+	void releasePrepared()
+	{
+		preparedPixmap = QPixmap();
+		preparedValid  = false;
+		pendingKey     = MPixmapCacheKey();
+	}
+
+	void preparePixmap(const MPixmapCacheKey & key)
+	{
+		if (preparedValid && samePrepared(preparedKey, key))
+			return;
+		preparedKey   = key;
+		preparedValid = true;
+
+		preparedPixmap = QPixmap::fromImage(MPixmapCache::prepareImage(sourcePixmap().toImage(), key.size, maskMode, maskAnchor));
+		preparedPixmap.setDevicePixelRatio(1);
 	}
 
 	MPixmapWidget* pixmapWidget;
 	MPixmapWidget::MaskMode maskMode = MASK_NONE;
 	MPixmapWidget::MaskAnchor maskAnchor = ANCHOR_TOP_LEFT;
 	QPixmap originalPixmap;
-	QPixmap preparedPixmap;
-	QPixmap scaledPixmap;
+	QPixmap moviePixmap;    ///< текущий кадр movie
+	QString imagePath;
+	QPixmap decodedPixmap;  ///< imagePath, декодированный под decodedKey
+	MPixmapCacheKey decodedKey;
+	MPixmapCacheKey pendingDecodeKey; ///< декодирование, которого виджет ждёт от MPixmapCache
+	QPixmap preparedPixmap; ///< исходное изображение, обрезанное маской, для preparedKey
+	MPixmapCacheKey preparedKey;
+	bool            preparedValid = false;
+	MPixmapCacheKey pendingKey;   ///< результат, которого виджет ждёт от MPixmapCache
+	QPixmap         renderedPixmap; ///< текущее готовое изображение для renderedKey
+	MPixmapCacheKey renderedKey;
 
 	QPointer<QMovie> movie;
 	QString          ownedMoviePath;
 	QMovie         * ownedMovie = nullptr;
+	bool             sharedMovie = false; ///< moviePath проигрывается из общего кэша кадров
+	QPixmap          sharedMovieFrame;    ///< последний показанный кадр из общего кэша
+	int              sharedMovieStartFrame = -1; ///< кадр, с которого начать при следующей подписке
 	int              borderRadius = 0;
 };
 
@@ -166,7 +372,6 @@ MPixmapWidget::MaskMode MPixmapWidget::maskMode() const
 void MPixmapWidget::setMaskMode(MPixmapWidget::MaskMode mode)
 {
 	m_impl->maskMode = mode;
-	m_impl->preparePixmap();
 	update();
 }
 
@@ -178,7 +383,6 @@ MPixmapWidget::MaskAnchor MPixmapWidget::maskAnchor() const
 void MPixmapWidget::setMaskAnchor(MPixmapWidget::MaskAnchor anchor)
 {
 	m_impl->maskAnchor = anchor;
-	m_impl->preparePixmap();
 	update();
 }
 
@@ -190,7 +394,20 @@ QPixmap MPixmapWidget::pixmap() const
 void MPixmapWidget::setPixmap(const QPixmap& pixmap)
 {
 	m_impl->originalPixmap = pixmap;
-	m_impl->preparePixmap();
+	update();
+}
+
+QString MPixmapWidget::imagePath() const
+{
+	return m_impl->imagePath;
+}
+
+void MPixmapWidget::setImagePath(const QString & path)
+{
+	if (m_impl->imagePath == path)
+		return;
+	m_impl->resetDecoded();
+	m_impl->imagePath = path;
 	update();
 }
 
@@ -209,6 +426,14 @@ QMovie * MPixmapWidget::movie() const
 	return m_impl->movie;
 }
 
+QMovie * MPixmapWidget::controllableMovie()
+{
+	// у общего кэша кадров объекта QMovie нет
+	if (m_impl->sharedMovie)
+		m_impl->initOwnedMovie(m_impl->ownedMoviePath);
+	return m_impl->movie;
+}
+
 void MPixmapWidget::setMovie(QMovie * movie)
 {
 	m_impl->initMovie(movie);
@@ -222,39 +447,75 @@ int MPixmapWidget::borderRadius() const
 void MPixmapWidget::setBorderRadius(int radius)
 {
 	m_impl->borderRadius = radius;
+	update();
 }
 
 void MPixmapWidget::paintEvent(QPaintEvent* event)
 {
 	QFrame::paintEvent(event);
-	if(m_impl->preparedPixmap.isNull())
+
+	if (m_impl->sharedMovie)
+	{
+		// кадры общего кэша уже масштабированы, обрезаны маской и скруглены
+		const QPixmap frame = m_impl->currentSharedMovieFrame();
+		if (m_impl->sharedMovie)
+		{
+			if (!frame.isNull())
+				QPainter(this).drawPixmap(rect(), frame, frame.rect());
+			return;
+		}
+	}
+
+	// пока файл декодируется под новый размер, быстро масштабируем прежний результат
+	if (!m_impl->movie && !m_impl->imagePath.isEmpty() && !m_impl->ensureDecoded(m_impl->deviceSize()))
+	{
+		if (!m_impl->decodedPixmap.isNull())
+		{
+			QPainter painter(this);
+			drawPreview(painter, rect(), m_impl->decodedPixmap, borderRadius());
+		}
+		return;
+	}
+
+	if(m_impl->sourcePixmap().isNull())
 		return;
 
 	/// @note Здесь не получится тупо взять и нарисовать preparedPixmap, так как нам нужно его
 	/// сперва отмасштабировать с Qt::SmoothTransformation, ибо, судя по качеству, по дефолту
 	/// масштабирование при отрисовке использует явно не его.
+	/// Оно выполняется в пуле потоков, а до его завершения рисуется быстро масштабированный preparedPixmap.
+	/// Готовые изображения (вместе со скруглением углов) хранятся в общем MPixmapCache, так что повторная
+	/// отрисовка - это просто копирование, а одинаковые виджеты разделяют один результат.
 
-	const QSize actualSize = (QSizeF(size()) * devicePixelRatioF()).toSize();
-	if(m_impl->scaledPixmap.isNull() || actualSize != m_impl->scaledPixmap.size())
-	{
-		m_impl->scaledPixmap = QPixmap::fromImage(m_impl->preparedPixmap.toImage().scaled(actualSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
-		m_impl->scaledPixmap.setDevicePixelRatio(1);
-	}
-
+	const MPixmapCacheKey key = m_impl->renderKey();
 	QPainter painter(this);
-	painter.setRenderHints(painter.renderHints() | RENDER_HINTS);
-	if (auto radius = borderRadius())
+
+	if (const QPixmap * rendered = m_impl->ensureRendered(key))
 	{
-		QPainterPath clipPath;
-		clipPath.addRoundedRect(rect(), radius, radius);
-		painter.setClipPath(clipPath);
+		painter.drawPixmap(rect(), *rendered, rendered->rect());
+		return;
 	}
-	painter.drawPixmap(rect(), m_impl->scaledPixmap, m_impl->scaledPixmap.rect());
+
+	if (!m_impl->preparedPixmap.isNull())
+		drawPreview(painter, rect(), m_impl->preparedPixmap, borderRadius());
+}
+
+void MPixmapWidget::renderFinished(const MPixmapCacheKey & key, const QPixmap & pixmap)
+{
+	m_impl->renderFinished(key, pixmap);
 }
 
 void MPixmapWidget::resizeEvent(QResizeEvent* event)
 {
 	QFrame::resizeEvent(event);
-	m_impl->preparePixmap();
 	update();
 }
+
+void MPixmapWidget::hideEvent(QHideEvent* event)
+{
+	QFrame::hideEvent(event);
+	// скрытый виджет не должен держать общий таймер анимаций; при отрисовке подписка восстановится с той же фазы
+	if (m_impl->sharedMovie && m_impl->sharedMovieStartFrame == -1)
+		m_impl->sharedMovieStartFrame = MPixmapCache::instance()->movieFrameNumber(this);
+	MPixmapCache::instance()->unsubscribeMovie(this);
+}
@@ -5,12 +5,20 @@
 
 #include "MovaviWidgetLib.h"
 
+struct MPixmapCacheKey;
+
 /// @brief Виджет, умеющий рисовать QPixmap. Отличия от QLabel:
 /// * QPixmap вписывается в текущие размеры виджета, логика при этом как с border-image из стилей;
 /// * QPixmap рисуется с учетом DPI экрана, то есть на Retina дисплеях будем иметь четкое изображение;
 /// * Поддерживается выбор масок, позволяющих получить специфически обрезанное изображение.
 /// * Поддерживается работа с анимированными GIF, для этого нужно указать либо путь до файла (moviePath),
 ///   либо передать готовый объект QMovie. В случае установки и pixmap, и moviePath, приоритет остаётся за гифкой.
+/// * Качественное масштабирование под размер виджета выполняется в пуле потоков: пока результат не готов,
+///   рисуется быстро масштабированное изображение, а запросы для уже неактуальных размеров отменяются.
+///   Готовый результат (с маской и скруглением углов) хранится в общем для всех виджетов MPixmapCache,
+///   поэтому повторная отрисовка - простое копирование, а одинаковые виджеты разделяют одно изображение.
+/// * Гифки из moviePath декодируются один раз на (путь, размер, маску) в общий кэш кадров MPixmapCache
+///   и проигрываются от общего таймера, так что десяток одинаковых индикаторов стоит одного декодирования.
 class MOVAVIWIDGET_API MPixmapWidget : public QFrame
 {
 	Q_OBJECT
@@ -18,6 +26,7 @@ class MOVAVIWIDGET_API MPixmapWidget : public QFrame
 	Q_PROPERTY(MaskMode   maskMode       READ maskMode     WRITE setMaskMode    )
 	Q_PROPERTY(MaskAnchor maskAnchor     READ maskAnchor   WRITE setMaskAnchor  )
 	Q_PROPERTY(QPixmap    pixmap         READ pixmap       WRITE setPixmap      )
+	Q_PROPERTY(QString    imagePath      READ imagePath    WRITE setImagePath   )
 	Q_PROPERTY(QString    moviePath      READ moviePath    WRITE setMoviePath   )
 	Q_PROPERTY(int        borderRadius   READ borderRadius WRITE setBorderRadius)
 
@@ -52,20 +61,40 @@ public:
 	QPixmap pixmap() const;
 	void setPixmap(const QPixmap & pixmap);
 
+	/// Путь к файлу изображения. В отличие от pixmap, файл декодируется в пуле потоков сразу уменьшенным
+	/// под размер виджета в физических пикселях и обрезанным маской, поэтому ни память, ни время декодирования
+	/// не зависят от разрешения файла. Повторно файл декодируется, только если виджет вырос больше
+	/// декодированного размера или заметно изменил пропорции при включённой маске. Приоритетнее pixmap.
+	QString imagePath() const;
+	void setImagePath(const QString & path);
+
 	QString moviePath() const;
 	void setMoviePath(const QString & path);
 
 	/// NOTE: управление за жизнью объекта на совести вызывающего кода.
 	/// MPixmapWidget не берёт на себя управления.
+	/// Для moviePath возвращает nullptr, пока анимация проигрывается из общего кэша кадров (см. controllableMovie()).
 	QMovie * movie() const;
 	void setMovie(QMovie *);
 
+	/// То же, что movie(), но анимацию из moviePath переключает с общего кэша кадров MPixmapCache
+	/// на собственный QMovie виджета, чтобы вызывающий код мог управлять воспроизведением.
+	/// Переключение необратимо до следующего setMoviePath() и стоит декодирования в GUI-потоке.
+	QMovie * controllableMovie();
+
 	int borderRadius() const;
 	void setBorderRadius(int radius);
 
 protected:
 	void paintEvent(QPaintEvent* event) override;
 	void resizeEvent(QResizeEvent* event) override;
+	void hideEvent(QHideEvent* event) override;
+
+private:
+	friend class MPixmapCache;
+
+	/// @brief Вызывается MPixmapCache, когда готово изображение, которого ждал виджет
+	void renderFinished(const MPixmapCacheKey & key, const QPixmap & pixmap);
 
 private:
 	struct Impl;
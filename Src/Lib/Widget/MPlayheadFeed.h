@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+
+#include <QtGlobal>
+
+#include "MovaviWidgetLib.h"
+
+/// @class MPlayheadFeed
+/// @brief Канал передачи текущей позиции воспроизведения из потока декодера в MTimelineSlider
+/// @details Производитель публикует время через атомарное 64-битное значение с любой частотой и из любого потока,
+/// без сигналов и очереди событий. Слайдер в режиме следования (MTimelineSlider::setFollowSource)
+/// сам считывает последнее значение раз в кадр, поэтому промежуточные значения просто перезаписываются.
+class MOVAVIWIDGET_API MPlayheadFeed
+{
+public:
+	explicit MPlayheadFeed(qint64 time = 0) : m_time(time) {}
+
+	MPlayheadFeed(const MPlayheadFeed &) = delete;
+	MPlayheadFeed & operator=(const MPlayheadFeed &) = delete;
+
+	/// @brief Публикует текущее время (в миллисекундах); можно вызывать из любого потока
+	void publish(qint64 time) { m_time.store(time, std::memory_order_relaxed); }
+
+	/// @brief Последнее опубликованное время
+	qint64 time() const { return m_time.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<qint64> m_time;
+};
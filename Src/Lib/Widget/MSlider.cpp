@@ -39,6 +39,8 @@ MSliderThumb::MSliderThumb(MSlider *parent)
 
 MSliderThumb::~MSliderThumb()
 {
+	for (MMagnetSliderThumbPoint *point : m_magnetPoints)
+		point->m_thumb = nullptr;
 	delete m_magnet;
 }
 
@@ -64,7 +66,12 @@ void MSliderThumb::setValue(int value)
 	m_value = value;
 	m_parent->moveThumbTo(this, m_value);
 	if (changed)
+	{
+		// точки уведомляются напрямую, а не через сигнал: слайдер иногда меняет значение с заблокированными сигналами
+		for (MMagnetSliderThumbPoint *point : m_magnetPoints)
+			point->setPosition(m_value);
 		emit valueChanged(m_value);
+	}
 }
 
 void MSliderThumb::mousePressEvent(QMouseEvent *event)
@@ -185,7 +192,10 @@ void MSliderThumb::keyPressEvent(QKeyEvent *event)
 MMagnet& MSliderThumb::magnet()
 {
 	if(!m_magnet)
+	{
 		m_magnet = new MMagnet(this->value());
+		m_magnet->setValuePerPixel(m_parent->valuePerPixel());
+	}
 	return *m_magnet;
 }
 
@@ -463,8 +473,12 @@ void MSlider::sliderChange(SliderChange change)
 
 void MSlider::updateThumbsValues()
 {
+	const double scale = valuePerPixel();
 	for (const auto thumb : m_thumbsByName)
 	{
+		if (thumb->m_magnet)
+			thumb->m_magnet->setValuePerPixel(scale); // для магнитов с зонами в пикселях
+
 		thumb->blockSignals(true);
 		thumb->setValue( thumb->value() );
 		thumb->blockSignals(false);
@@ -524,6 +538,12 @@ void MSlider::paintEvent(QPaintEvent *event)
 	QSlider::paintEvent(event);
 }
 
+double MSlider::valuePerPixel()
+{
+	const int grooveLength = (orientation() == Qt::Horizontal ? width() : height()) - 2*grooveOffset();
+	return static_cast<double>(maximum() - minimum()) / std::max(1, grooveLength);
+}
+
 MSliderThumb * MSlider::positionableThumb() const
 {
 	QList<MSliderThumb *> order;
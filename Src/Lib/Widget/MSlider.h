@@ -3,6 +3,7 @@
 #include <QWidget>
 #include <QSlider>
 #include <QMap>
+#include <QVector>
 #include <QToolButton>
 
 #include "MovaviWidgetLib.h"
@@ -12,6 +13,7 @@
 class MSlider;
 class MSliderThumb;
 class MMagnet;
+class MMagnetSliderThumbPoint;
 
 /** @class MSliderThumb
  *  @brief Ручка для слайдера MSlider
@@ -93,6 +95,7 @@ protected:
 
 private:
 	friend class MSlider;
+	friend class MMagnetSliderThumbPoint;
 
 	MSlider *m_parent;
 
@@ -100,6 +103,9 @@ private:
 	/// @details Создаётся только в случаи, когда пользователь запросил  magnet()
 	MMagnet *m_magnet;
 
+	/// @brief Точки примагничивания, следящие за этой ручкой; получают новое значение прямо из setValue()
+	QVector<MMagnetSliderThumbPoint *> m_magnetPoints;
+
 	QPoint m_pressedAt;
 
 	QString m_name;
@@ -215,6 +221,8 @@ public:
 	int correctStickValue(MSliderThumb *thumb, int value); ///< корректирует значение перетаскиваемого слайдера thumb в зависимости от значения defaultThumb
 
 	int pointToValue(QPoint point);
+
+	double valuePerPixel(); ///< единиц значения на пиксель "щели" (масштаб для MMagnet::PixelUnits)
 	/// @}
 
 private slots:
@@ -0,0 +1,166 @@
+#include "MSliderMagneticPoints.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <QAbstractSlider>
+#include <QMouseEvent>
+#include <QStyle>
+
+MSliderMagneticPoints::MSliderMagneticPoints(QAbstractSlider * slider, const QVector<int> & magneticValues, int magneticDistPx)
+	: QObject(slider)
+	, m_slider(slider)
+	, m_magneticDist(magneticDistPx)
+{
+	setValues(magneticValues);
+	m_slider->installEventFilter(this);
+	connect(m_slider, &QAbstractSlider::rangeChanged, this, [this] { invalidate(); });
+}
+
+MSliderMagneticPoints::~MSliderMagneticPoints()
+{
+	m_slider->removeEventFilter(this);
+}
+
+void MSliderMagneticPoints::setValues(const QVector<int> & values)
+{
+	m_values = values;
+	std::sort(m_values.begin(), m_values.end());
+	m_values.erase(std::unique(m_values.begin(), m_values.end()), m_values.end());
+	invalidate();
+}
+
+void MSliderMagneticPoints::addValue(int value)
+{
+	const auto it = std::lower_bound(m_values.begin(), m_values.end(), value);
+	if (it != m_values.end() && *it == value)
+		return;
+	m_values.insert(it, value);
+	invalidate();
+}
+
+void MSliderMagneticPoints::removeValue(int value)
+{
+	const auto it = std::lower_bound(m_values.begin(), m_values.end(), value);
+	if (it == m_values.end() || *it != value)
+		return;
+	m_values.erase(it);
+	invalidate();
+}
+
+void MSliderMagneticPoints::setMagneticDistance(int px)
+{
+	m_magneticDist = px;
+}
+
+int MSliderMagneticPoints::posToValue(int pos) const
+{
+	const int span = m_slider->orientation() == Qt::Horizontal ? m_slider->width() : m_slider->height();
+	const bool invert = m_slider->orientation() == Qt::Vertical;
+	return QStyle::sliderValueFromPosition(m_slider->minimum(), m_slider->maximum(), pos, span, invert);
+}
+
+int MSliderMagneticPoints::valueToPos(int value) const
+{
+	const int span = m_slider->orientation() == Qt::Horizontal ? m_slider->width() : m_slider->height();
+	const bool invert = m_slider->orientation() == Qt::Vertical;
+	return QStyle::sliderPositionFromValue(m_slider->minimum(), m_slider->maximum(), value, span, invert);
+}
+
+void MSliderMagneticPoints::invalidate()
+{
+	m_positionsValid = false;
+	m_currentPoint = -1;
+}
+
+void MSliderMagneticPoints::ensurePositions()
+{
+	if (m_positionsValid)
+		return;
+
+	// у вертикального слайдера позиции убывают с ростом значения, поэтому порядок восстанавливаем сортировкой
+	QVector<QPair<int, int>> points;
+	points.reserve(m_values.size());
+	for (int value : m_values)
+		points.append(qMakePair(valueToPos(value), value));
+	std::sort(points.begin(), points.end());
+
+	m_positions.resize(points.size());
+	m_positionValues.resize(points.size());
+	for (int i = 0; i < points.size(); ++i)
+	{
+		m_positions[i]      = points[i].first;
+		m_positionValues[i] = points[i].second;
+	}
+	m_positionsValid = true;
+}
+
+int MSliderMagneticPoints::nearestPoint(int pos) const
+{
+	if (m_positions.isEmpty())
+		return -1;
+
+	const int index = std::lower_bound(m_positions.begin(), m_positions.end(), pos) - m_positions.begin();
+	if (index == m_positions.size())
+		return index - 1;
+	if (index > 0 && pos - m_positions[index - 1] < m_positions[index] - pos)
+		return index - 1;
+	return index;
+}
+
+bool MSliderMagneticPoints::eventFilter(QObject * watched, QEvent * event)
+{
+	if (watched != m_slider)
+		return QObject::eventFilter(watched, event);
+
+	if (event->type() == QEvent::Resize)
+		invalidate();
+
+	if (event->type() != QEvent::MouseMove)
+		return QObject::eventFilter(watched, event);
+
+	if (!m_slider->isSliderDown() || !m_slider->hasFocus())
+		return QObject::eventFilter(watched, event);
+
+	ensurePositions();
+
+	QMouseEvent * moveEvent = static_cast<QMouseEvent*>(event);
+	const int curPos    = m_slider->orientation() == Qt::Horizontal ? moveEvent->pos().x() : moveEvent->pos().y();
+	const int direction = curPos - m_previousPos;
+	if (direction == 0) // на маке приходят лишние события мыши с повторяющимися координатами, что приводит к отскоку слайдера к позиции курсора
+		return true;
+
+	const int point = nearestPoint(curPos);
+	if (point < 0)
+	{
+		m_previousPos = curPos;
+		return QObject::eventFilter(watched, event);
+	}
+
+	const int magneticPos = m_positions[point];
+	if (point != m_currentPoint)
+	{
+		// ближайшей стала другая точка: магнитимся к ней, только если до этого события были вне её зоны
+		m_currentPoint  = point;
+		m_needMagnetize = std::abs(m_previousPos - magneticPos) > m_magneticDist;
+	}
+
+	const bool inside = std::abs(curPos - magneticPos) <= m_magneticDist;
+	const bool moveToMagneticPoint = (direction * (magneticPos - curPos)) > 0;
+	bool shouldMagnetize = false;
+
+	if (moveToMagneticPoint)
+		shouldMagnetize = inside && m_needMagnetize;
+	else
+		m_needMagnetize = !inside;
+
+	m_previousPos = curPos;
+
+	if (!inside)
+		return QObject::eventFilter(watched, event);
+	if (shouldMagnetize)
+		m_slider->setSliderPosition(m_positionValues[point]);
+	else
+		m_slider->setSliderPosition(posToValue(curPos)); // см. MSliderMagneticPoint: базовый eventFilter не ставит слайдер на нужную позицию
+	return true;
+}
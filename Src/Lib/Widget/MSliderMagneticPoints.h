@@ -0,0 +1,63 @@
+#pragma once
+
+#include <QObject>
+#include <QVector>
+
+#include "MovaviWidgetLib.h"
+
+/**
+ * @class MSliderMagneticPoints
+ * @brief MSliderMagneticPoints позволяет магнититься к нескольким точкам на слайдере.
+ *
+ * В отличие от нескольких MSliderMagneticPoint, на слайдер устанавливается один фильтр событий.
+ * Пиксельные позиции точек кэшируются и пересчитываются только при изменении размера или диапазона слайдера,
+ * а ближайшая к курсору точка находится двоичным поиском.
+ * Для ближайшей точки действуют те же правила, что и в MSliderMagneticPoint: магнитится только при движении
+ * к точке, если слайдер был вне её зоны примагничивания.
+ */
+
+class QAbstractSlider;
+
+class MOVAVIWIDGET_API MSliderMagneticPoints : public QObject
+{
+public:
+	/**
+	 * @brief принимает указатель на слайдер и устанавливает ему фильтр.
+	 * @a slider слайдер, который надо магнитить
+	 * @a magneticValues - значения слайдера, к которым надо магнититься
+	 * @a magneticDistPx - интервал примагничивания в пикселях
+	*/
+	MSliderMagneticPoints(QAbstractSlider * slider, const QVector<int> & magneticValues, int magneticDistPx);
+	~MSliderMagneticPoints();
+
+	QVector<int> values() const { return m_values; } ///< значения точек по возрастанию
+	void setValues(const QVector<int> & values);
+	void addValue(int value);
+	void removeValue(int value);
+
+	int magneticDistance() const { return m_magneticDist; }
+	void setMagneticDistance(int px);
+
+protected:
+	bool eventFilter(QObject * watched, QEvent * event) override;
+
+private:
+	int valueToPos(int value) const;
+	int posToValue(int pos) const;
+
+	void invalidate();
+	void ensurePositions();
+	int nearestPoint(int pos) const; ///< индекс в m_positions или -1
+
+private:
+	QAbstractSlider * m_slider;
+	QVector<int> m_values;         ///< отсортированные значения точек
+	QVector<int> m_positions;      ///< позиции точек в пикселях по возрастанию
+	QVector<int> m_positionValues; ///< значение точки для каждого элемента m_positions
+	bool m_positionsValid = false;
+
+	int m_magneticDist;
+	int m_previousPos = 0;
+	int m_currentPoint = -1;
+	bool m_needMagnetize = false;
+};
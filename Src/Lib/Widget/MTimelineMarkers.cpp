@@ -0,0 +1,86 @@
+#include "MTimelineMarkers.h"
+
+#include <algorithm>
+#include <limits>
+
+void MTimelineMarkers::setMarkers(QVector<MTimelineMarker> markers)
+{
+	m_markers = std::move(markers);
+	std::stable_sort(m_markers.begin(), m_markers.end(), [](const MTimelineMarker & lhs, const MTimelineMarker & rhs) {
+		return lhs.time < rhs.time;
+	});
+
+	m_starts.resize(m_markers.size());
+	m_maxEnds.resize(m_markers.size());
+	for (int i = 0; i < m_markers.size(); ++i)
+		m_starts[i] = m_markers[i].time;
+
+	buildIndex(0, m_markers.size());
+}
+
+void MTimelineMarkers::clear()
+{
+	m_markers.clear();
+	m_starts.clear();
+	m_maxEnds.clear();
+}
+
+qint64 MTimelineMarkers::buildIndex(int lo, int hi)
+{
+	if (lo >= hi)
+		return std::numeric_limits<qint64>::min();
+
+	const int mid = lo + (hi - lo) / 2;
+	const qint64 maxEnd = std::max({ m_markers[mid].endTime(), buildIndex(lo, mid), buildIndex(mid + 1, hi) });
+	m_maxEnds[mid] = maxEnd;
+	return maxEnd;
+}
+
+void MTimelineMarkers::query(qint64 from, qint64 to, QVector<int> & result) const
+{
+	if (from > to)
+		return;
+	query(0, m_markers.size(), from, to, result);
+}
+
+void MTimelineMarkers::query(int lo, int hi, qint64 from, qint64 to, QVector<int> & result) const
+{
+	while (lo < hi)
+	{
+		const int mid = lo + (hi - lo) / 2;
+		if (m_maxEnds[mid] < from) // ни один интервал поддерева не доходит до from
+			return;
+
+		query(lo, mid, from, to, result);
+
+		if (m_starts[mid] > to) // правее все начинаются ещё позже
+			return;
+		if (m_markers[mid].endTime() >= from)
+			result.append(mid);
+
+		lo = mid + 1; // правое поддерево - без рекурсии
+	}
+}
+
+int MTimelineMarkers::nearest(qint64 time, qint64 tolerance) const
+{
+	QVector<int> candidates;
+	query(time - tolerance, time + tolerance, candidates);
+
+	int    nearestIndex    = -1;
+	qint64 nearestDistance = std::numeric_limits<qint64>::max();
+	for (int index : candidates)
+	{
+		const MTimelineMarker & marker = m_markers[index];
+		const qint64 distance = (time < marker.time)      ? marker.time - time
+		                      : (time > marker.endTime()) ? time - marker.endTime()
+		                      : 0;
+		// при равенстве предпочитаем точечные маркеры и более короткие главы - они "ближе" к курсору
+		if (distance < nearestDistance || (distance == nearestDistance && marker.duration < m_markers[nearestIndex].duration))
+		{
+			nearestIndex = index;
+			nearestDistance = distance;
+		}
+	}
+	return nearestIndex;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <QColor>
+#include <QString>
+#include <QVector>
+
+#include "MovaviWidgetLib.h"
+
+/// @brief Маркер (duration == 0) или глава (duration > 0) на шкале MTimelineSlider
+struct MOVAVIWIDGET_API MTimelineMarker
+{
+	qint64  time = 0;     ///< начало в миллисекундах
+	qint64  duration = 0; ///< длительность в миллисекундах
+	QString label;
+	QColor  color;
+
+	MTimelineMarker() = default;
+	MTimelineMarker(qint64 time, qint64 duration, const QString & label, const QColor & color = QColor())
+		: time(time), duration(duration), label(label), color(color) { }
+
+	qint64 endTime() const { return time + duration; }
+};
+
+/// @class MTimelineMarkers
+/// @brief Набор маркеров с поиском пересечений с интервалом за O(log n + k)
+/// @details Маркеры хранятся в массиве, отсортированном по началу, который рассматривается как неявное
+/// сбалансированное дерево поиска: корень поддерева [lo, hi) - элемент (lo + hi) / 2. Для каждого узла
+/// хранится максимальный конец интервала в поддереве, что позволяет отсекать поддеревья без пересечений.
+/// Поэтому десятки тысяч маркеров не требуют ни отдельных виджетов, ни перебора при наведении и отрисовке.
+class MOVAVIWIDGET_API MTimelineMarkers
+{
+public:
+	/// @brief Заменяет набор маркеров; сортировка и построение индекса - O(n log n)
+	void setMarkers(QVector<MTimelineMarker> markers);
+	void clear();
+
+	bool isEmpty() const { return m_markers.isEmpty(); }
+	int  size() const    { return m_markers.size(); }
+
+	/// @brief Маркеры, отсортированные по началу
+	const QVector<MTimelineMarker> & markers() const { return m_markers; }
+	const MTimelineMarker & at(int index) const    { return m_markers[index]; }
+
+	/// @brief Добавляет в @a result индексы маркеров, пересекающихся с [from, to], в порядке возрастания начала
+	void query(qint64 from, qint64 to, QVector<int> & result) const;
+
+	/// @brief Индекс маркера, ближайшего к @a time в пределах @a tolerance, или -1
+	int nearest(qint64 time, qint64 tolerance) const;
+
+private:
+	qint64 buildIndex(int lo, int hi);
+	void query(int lo, int hi, qint64 from, qint64 to, QVector<int> & result) const;
+
+private:
+	QVector<MTimelineMarker> m_markers;
+	QVector<qint64>          m_starts;  ///< начала маркеров подряд, для компактного обхода
+	QVector<qint64>          m_maxEnds; ///< максимальный конец в поддереве с корнем в данном элементе
+};
@@ -0,0 +1,260 @@
+#include "MTimelinePreview.h"
+
+#include <cassert>
+
+#include <QCache>
+#include <QHash>
+#include <QLabel>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPixmap>
+#include <QRunnable>
+#include <QThreadPool>
+
+namespace {
+
+const QSize  DEFAULT_FRAME_SIZE   = QSize(160, 90);
+const qint64 DEFAULT_QUANTUM      = 500;
+const int    DEFAULT_CACHE_LIMIT  = 32 * 1024 * 1024;
+const int    POPUP_CURSOR_SPACING = 8;
+
+/// Адресат результатов: задачи пула обращаются к нему под мьютексом,
+/// поэтому уничтоженное превью не получит кадр в уже удалённый объект.
+struct Receiver
+{
+	QMutex mutex;
+	QObject * preview = nullptr;
+};
+
+class FrameTask : public QRunnable
+{
+public:
+	FrameTask(std::shared_ptr<Receiver> receiver, std::shared_ptr<MTimelinePreviewProvider> provider,
+		std::shared_ptr<std::atomic<bool>> cancelled, int ticket, qint64 time, const QSize & size)
+		: m_receiver(std::move(receiver))
+		, m_provider(std::move(provider))
+		, m_cancelled(std::move(cancelled))
+		, m_ticket(ticket)
+		, m_time(time)
+		, m_size(size)
+	{ }
+
+	void run() override
+	{
+		if (*m_cancelled)
+			return;
+
+		const QImage image = m_provider->frame(m_time, m_size, *m_cancelled);
+		if (*m_cancelled)
+			return;
+
+		QMutexLocker locker(&m_receiver->mutex);
+		if (m_receiver->preview)
+			QMetaObject::invokeMethod(m_receiver->preview, "frameReady", Qt::QueuedConnection, Q_ARG(qint64, m_time), Q_ARG(int, m_ticket), Q_ARG(QImage, image));
+	}
+
+private:
+	std::shared_ptr<Receiver>                 m_receiver;
+	std::shared_ptr<MTimelinePreviewProvider> m_provider;
+	std::shared_ptr<std::atomic<bool>>        m_cancelled;
+	int    m_ticket;
+	qint64 m_time;
+	QSize  m_size;
+};
+
+} // namespace
+
+struct MTimelinePreview::Impl
+{
+	/// Незавершённый запрос кадра; номер отличает его результат от результата отменённого запроса того же ключа
+	struct Pending
+	{
+		int ticket = 0;
+		std::shared_ptr<std::atomic<bool>> cancelled;
+	};
+
+	Impl(MTimelinePreview * preview, QWidget * slider)
+		: receiver(std::make_shared<Receiver>())
+		, popup(new QLabel(slider, Qt::ToolTip | Qt::FramelessWindowHint))
+	{
+		receiver->preview = preview;
+		popup->setObjectName(QStringLiteral("timelinePreview"));
+		popup->setAttribute(Qt::WA_TransparentForMouseEvents);
+		popup->setAlignment(Qt::AlignCenter);
+		popup->setFixedSize(frameSize);
+		cache.setMaxCost(DEFAULT_CACHE_LIMIT);
+	}
+
+	~Impl()
+	{
+		{
+			QMutexLocker locker(&receiver->mutex);
+			receiver->preview = nullptr;
+		}
+		cancelPending(-1);
+	}
+
+	qint64 quantize(qint64 time) const
+	{
+		return time / quantum * quantum;
+	}
+
+	/// Отменяет все незавершённые запросы, кроме запроса для @a keepKey
+	void cancelPending(qint64 keepKey)
+	{
+		for (auto it = pending.begin(); it != pending.end(); )
+		{
+			if (it.key() == keepKey)
+			{
+				++it;
+				continue;
+			}
+			*it->cancelled = true;
+			it = pending.erase(it);
+		}
+	}
+
+	void request(qint64 key)
+	{
+		if (!provider || pending.contains(key))
+			return;
+
+		Pending & request = pending[key];
+		request.ticket    = nextTicket++;
+		request.cancelled = std::make_shared<std::atomic<bool>>(false);
+		QThreadPool::globalInstance()->start(new FrameTask(receiver, provider, request.cancelled, request.ticket, key, frameSize));
+	}
+
+	void display(const QImage & image)
+	{
+		popup->setPixmap(QPixmap::fromImage(image));
+	}
+
+	void reset()
+	{
+		cancelPending(-1);
+		cache.clear();
+		popup->clear();
+	}
+
+	std::shared_ptr<Receiver>                 receiver;
+	std::shared_ptr<MTimelinePreviewProvider> provider;
+
+	QLabel * popup;
+	QSize    frameSize = DEFAULT_FRAME_SIZE;
+	qint64   quantum   = DEFAULT_QUANTUM;
+	qint64   currentKey = -1;
+
+	QCache<qint64, QImage> cache; // стоимость элемента - размер кадра в байтах
+	QHash<qint64, Pending> pending;
+	int nextTicket = 0;
+};
+
+MTimelinePreview::MTimelinePreview(QWidget * slider)
+	: QObject(slider)
+	, m_impl(new Impl(this, slider))
+{ }
+
+MTimelinePreview::~MTimelinePreview() = default;
+
+std::shared_ptr<MTimelinePreviewProvider> MTimelinePreview::provider() const
+{
+	return m_impl->provider;
+}
+
+void MTimelinePreview::setProvider(std::shared_ptr<MTimelinePreviewProvider> provider)
+{
+	m_impl->reset();
+	m_impl->provider = std::move(provider);
+	if (!m_impl->provider)
+		hide();
+}
+
+QSize MTimelinePreview::frameSize() const
+{
+	return m_impl->frameSize;
+}
+
+void MTimelinePreview::setFrameSize(const QSize & size)
+{
+	if (m_impl->frameSize == size)
+		return;
+	m_impl->reset();
+	m_impl->frameSize = size;
+	m_impl->popup->setFixedSize(size);
+}
+
+qint64 MTimelinePreview::quantum() const
+{
+	return m_impl->quantum;
+}
+
+void MTimelinePreview::setQuantum(qint64 msecs)
+{
+	assert(msecs > 0);
+	if (msecs <= 0 || m_impl->quantum == msecs)
+		return;
+	m_impl->reset();
+	m_impl->quantum = msecs;
+}
+
+int MTimelinePreview::cacheLimit() const
+{
+	return m_impl->cache.maxCost();
+}
+
+void MTimelinePreview::setCacheLimit(int bytes)
+{
+	m_impl->cache.setMaxCost(bytes);
+}
+
+void MTimelinePreview::showAt(const QPoint & globalPos, qint64 time)
+{
+	if (!m_impl->provider)
+		return;
+
+	const qint64 key = m_impl->quantize(time);
+	if (key != m_impl->currentKey)
+	{
+		m_impl->currentKey = key;
+		m_impl->cancelPending(key);
+
+		if (const QImage * image = m_impl->cache.object(key))
+			m_impl->display(*image);
+		else
+			m_impl->request(key);
+	}
+
+	QLabel * popup = m_impl->popup;
+	popup->move(globalPos - QPoint(popup->width() / 2, popup->height() + POPUP_CURSOR_SPACING));
+	if (!popup->isVisible() && !popup->pixmap())
+		return; // нечего показывать, пока не пришёл первый кадр
+	popup->show();
+}
+
+void MTimelinePreview::hide()
+{
+	m_impl->cancelPending(-1);
+	m_impl->currentKey = -1;
+	m_impl->popup->hide();
+}
+
+void MTimelinePreview::frameReady(qint64 key, int ticket, const QImage & image)
+{
+	// кадр отменённого запроса мог быть отправлен до отмены: он может относиться к прежним
+	// провайдеру, размеру или кванту, а ключ уже может ждать кадра от нового запроса
+	const auto it = m_impl->pending.find(key);
+	if (it == m_impl->pending.end() || it->ticket != ticket)
+		return;
+	m_impl->pending.erase(it);
+	if (image.isNull())
+		return;
+
+	m_impl->cache.insert(key, new QImage(image), int(image.sizeInBytes()));
+
+	if (key == m_impl->currentKey)
+	{
+		m_impl->display(image);
+		m_impl->popup->show();
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include <QImage>
+#include <QObject>
+#include <QScopedPointer>
+
+#include "MovaviWidgetLib.h"
+
+class QWidget;
+
+/// @class MTimelinePreviewProvider
+/// @brief Источник кадров для всплывающего превью MTimelineSlider
+class MOVAVIWIDGET_API MTimelinePreviewProvider
+{
+public:
+	virtual ~MTimelinePreviewProvider() {}
+
+	/// @brief Возвращает кадр для момента времени @a time (в миллисекундах), вписанный в @a size
+	/// @note Вызывается в потоке пула, а не в GUI-потоке. Долгие реализации должны периодически
+	/// проверять @a cancelled и прерываться, если кадр больше не нужен.
+	virtual QImage frame(qint64 time, const QSize & size, const std::atomic<bool> & cancelled) = 0;
+};
+
+/// @class MTimelinePreview
+/// @brief Всплывающее превью кадра под курсором для MTimelineSlider
+/// @details Кадры запрашиваются у MTimelinePreviewProvider в пуле потоков, GUI-поток никогда не ждёт декодирования.
+/// Время квантуется с шагом quantum(), готовые кадры хранятся в кэше, ограниченном по объёму в байтах
+/// (вытесняются давно не использованные). Пока пользователь скраббит, ещё не выполненные запросы
+/// для моментов времени, с которых курсор уже ушёл, отменяются. До прихода нужного кадра показывается предыдущий.
+class MOVAVIWIDGET_API MTimelinePreview : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit MTimelinePreview(QWidget * slider);
+	~MTimelinePreview();
+
+	std::shared_ptr<MTimelinePreviewProvider> provider() const;
+	void setProvider(std::shared_ptr<MTimelinePreviewProvider> provider); ///< сбрасывает кэш; nullptr выключает превью
+
+	QSize frameSize() const;
+	void setFrameSize(const QSize & size); ///< размер кадра в пикселях, сбрасывает кэш
+
+	qint64 quantum() const;
+	void setQuantum(qint64 msecs); ///< шаг квантования времени (ключа кэша) в миллисекундах
+
+	int cacheLimit() const;
+	void setCacheLimit(int bytes); ///< максимальный объём кэша кадров в байтах
+
+	/// @brief Показывает превью для момента времени @a time над точкой @a globalPos
+	void showAt(const QPoint & globalPos, qint64 time);
+	/// @brief Скрывает превью и отменяет все незавершённые запросы
+	void hide();
+
+private slots:
+	void frameReady(qint64 key, int ticket, const QImage & image);
+
+private:
+	struct Impl;
+	QScopedPointer<Impl> m_impl;
+};
@@ -1,12 +1,160 @@
 #include "MTimelineSlider.h"
+#include "MTimelinePreview.h"
+#include "MTimelineWaveform.h"
+#include "MPlayheadFeed.h"
 
 #include <algorithm>
 
 #include <QMouseEvent>
+#include <QNativeGestureEvent>
+#include <QPainter>
 #include <QToolTip>
 #include <QTime>
+#include <QTimer>
+#include <QWheelEvent>
 
 #include <cassert>
+#include <climits>
+#include <cmath>
+
+namespace {
+
+const QString DEFAULT_TOOLTIP_FORMAT = QStringLiteral("hh:mm:ss");
+const qint64  TOOLTIP_PRECISION_MS   = 1000; // время в подсказке отображается с точностью до секунды
+
+const double WHEEL_ZOOM_FACTOR = 0.8;  // изменение видимой части за один шаг колеса
+const double WHEEL_PAN_FRACTION = 0.1; // сдвиг за один шаг колеса в долях видимой части
+
+// "Круглые" шаги делений линейки в миллисекундах
+const qint64 RULER_STEPS[] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500,
+	1000, 2000, 5000, 10000, 15000, 30000,
+	60000, 2*60000, 5*60000, 10*60000, 15*60000, 30*60000,
+	3600000, 2*3600000, 3*3600000, 6*3600000, 12*3600000, 24*3600000,
+};
+const int RULER_STEP_COUNT        = sizeof(RULER_STEPS) / sizeof(RULER_STEPS[0]);
+const int RULER_MIN_TICK_SPACING  = 6;    // px между мелкими делениями
+const int RULER_LABEL_PADDING     = 16;   // px между подписями
+const int RULER_MINOR_TICK        = 3;
+const int RULER_MAJOR_TICK        = 7;
+const int RULER_LABEL_CACHE_LIMIT = 1024;
+
+const int MARKER_HIT_TOLERANCE = 3;  // px, в пределах которых наведение попадает на маркер
+const int MARKER_STRIP_HEIGHT  = 4;  // px, высота полосы глав
+const int CHAPTER_ALPHA        = 96;
+
+const int FOLLOW_INTERVAL = 16; // мс, примерно один кадр при 60 Гц
+
+QString rulerFormat(qint64 step, bool hasHours)
+{
+	if (step < 1000)
+		return hasHours ? QStringLiteral("h:mm:ss.zzz") : QStringLiteral("m:ss.zzz");
+	return hasHours ? QStringLiteral("h:mm:ss") : QStringLiteral("m:ss");
+}
+
+qint64 ceilToStep(qint64 value, qint64 step)
+{
+	qint64 result = value / step * step;
+	return result < value ? result + step : result;
+}
+
+void appendNumber(QString & out, qint64 value, int width)
+{
+	QChar digits[20];
+	int count = 0;
+	do
+	{
+		digits[count++] = QLatin1Char('0' + static_cast<char>(value % 10));
+		value /= 10;
+	} while (value > 0);
+
+	for (int i = count; i < width; ++i)
+		out += QLatin1Char('0');
+	while (count > 0)
+		out += digits[--count];
+}
+
+/// Есть ли в шаблоне вне кавычек AP/ap/A/a, то есть 12-часовой формат
+bool hasAmPm(const QString & format)
+{
+	bool quoted = false;
+	for (const QChar c : format)
+	{
+		if (c == QLatin1Char('\''))
+			quoted = !quoted;
+		else if (!quoted && (c == QLatin1Char('a') || c == QLatin1Char('A')))
+			return true;
+	}
+	return false;
+}
+
+/// Форматирует время в миллисекундах по шаблону в терминах QTime::toString (h, hh, m, mm, s, ss, z, zzz, текст в кавычках).
+/// В отличие от QTime не создаёт промежуточных объектов и не ограничено 24 часами.
+/// 12-часовые шаблоны (с AP/a) отдаются QTime::toString: там h означает 1-12 и нужен суффикс AM/PM.
+QString formatTime(qint64 msecs, const QString & format)
+{
+	msecs = qMax(msecs, 0LL);
+	if (hasAmPm(format))
+		return QTime(0, 0).addMSecs(static_cast<int>(msecs % (24 * 3600000))).toString(format);
+	const qint64 hours   = msecs / 3600000;
+	const qint64 minutes = msecs / 60000 % 60;
+	const qint64 seconds = msecs / 1000 % 60;
+	const qint64 millis  = msecs % 1000;
+
+	QString result;
+	result.reserve(format.size() + 4);
+
+	const int size = format.size();
+	for (int i = 0; i < size; )
+	{
+		const QChar c = format[i];
+
+		if (c == QLatin1Char('\''))
+		{
+			int end = format.indexOf(QLatin1Char('\''), i + 1);
+			if (end == i + 1) // '' - экранированная кавычка
+			{
+				result += c;
+				i += 2;
+				continue;
+			}
+			if (end < 0)
+				end = size;
+			result += format.midRef(i + 1, end - i - 1);
+			i = end + 1;
+			continue;
+		}
+
+		int    maxRun = 0;
+		qint64 value  = 0;
+		switch (c.unicode())
+		{
+		case 'h':
+		case 'H': maxRun = 2; value = hours;   break;
+		case 'm': maxRun = 2; value = minutes; break;
+		case 's': maxRun = 2; value = seconds; break;
+		case 'z': maxRun = 3; value = millis;  break;
+		default:  break;
+		}
+
+		if (maxRun == 0)
+		{
+			result += c;
+			++i;
+			continue;
+		}
+
+		int run = 1;
+		while (run < maxRun && i + run < size && format[i + run] == c)
+			++run;
+		appendNumber(result, value, run == maxRun ? maxRun : 1);
+		i += run;
+	}
+
+	return result;
+}
+
+} // namespace
 
 MTimelineSlider::MTimelineSlider(QWidget *parent/* = 0*/)
 	: MSlider(parent)
@@ -16,6 +164,20 @@ MTimelineSlider::MTimelineSlider(QWidget *parent/* = 0*/)
 	, m_rightBound(-1)
 	, m_time(0)
 	, m_boundingMode(FullSliderWidth)
+	, m_tooltipFormat(DEFAULT_TOOLTIP_FORMAT)
+	, m_preview(nullptr)
+	, m_waveform(nullptr)
+	, m_followTimer(nullptr)
+	, m_zoomEnabled(false)
+	, m_zoomed(false)
+	, m_visibleStart(0)
+	, m_visibleEnd(0)
+	, m_silentMove(false)
+	, m_isPanning(false)
+	, m_panStartX(0)
+	, m_panStartTime(0)
+	, m_rulerVisible(false)
+	, m_rulerMajorStep(0)
 {
 	//если менять m_time только в valueChanged, то в обработчике сигнала sliderMoved значения value() и time() будут несогласованы, т.к. value меняется перед вызовом sliderMoved в QAbstractSlider::setValue
 	//порядок сигналов в пользовательском коде: timeChanged -> sliderMoved(только при пользовательском вводе) -> valueChanged
@@ -36,6 +198,20 @@ void MTimelineSlider::setStyleTag( const QString &str )
 void MTimelineSlider::setDisplayFormatList( const QStringList &list )
 {
 	m_displayFormatList = list;
+	updateTooltipFormat();
+}
+
+void MTimelineSlider::setZoomEnabled( bool enabled )
+{
+	m_zoomEnabled = enabled;
+}
+
+void MTimelineSlider::setRulerVisible( bool visible )
+{
+	if (m_rulerVisible == visible)
+		return;
+	m_rulerVisible = visible;
+	update();
 }
 
 void MTimelineSlider::setTimeRange(qint64 min, qint64 max)
@@ -49,6 +225,7 @@ void MTimelineSlider::setStartTime(qint64 startTime)
 	if (startTime == m_startTime)
 		return;
 	m_startTime = startTime;
+	clampVisibleRange();
 
 	// Reapplying bounds to thumb because it might has been miscalculated in case setBoundRange() was called before setStartTime()/setEndTime().
 	if (m_leftBound >= 0)
@@ -56,6 +233,7 @@ void MTimelineSlider::setStartTime(qint64 startTime)
 	if (m_rightBound >= 0)
 		defaultThumb()->setMaximum(time2position(m_rightBound));
 
+	updateTooltipFormat();
 	setTime(m_time);
 }
 
@@ -64,6 +242,7 @@ void MTimelineSlider::setEndTime(qint64 endTime)
 	if (endTime == m_endTime)
 		return;
 	m_endTime = endTime;
+	clampVisibleRange();
 
 	// Reapplying bounds to thumb because it might has been miscalculated in case setBoundRange() was called before setStartTime()/setEndTime().
 	if (m_leftBound >= 0)
@@ -71,6 +250,7 @@ void MTimelineSlider::setEndTime(qint64 endTime)
 	if (m_rightBound >= 0)
 		defaultThumb()->setMaximum(time2position(m_rightBound));
 
+	updateTooltipFormat();
 	setTime(m_time);
 }
 
@@ -85,8 +265,10 @@ void MTimelineSlider::setBoundRange(qint64 left, qint64 right)
 void MTimelineSlider::removeBoundRange()
 {
 	m_leftBound = m_rightBound = -1;
+	clampVisibleRange();
 	defaultThumb()->setMinimum(minimum());
 	defaultThumb()->setMaximum(maximum());
+	updateTooltipFormat();
 }
 
 void MTimelineSlider::setLeftBound(qint64 left)
@@ -94,7 +276,9 @@ void MTimelineSlider::setLeftBound(qint64 left)
 	if (m_leftBound == left)
 		return;
 	m_leftBound = left;
+	clampVisibleRange();
 	defaultThumb()->setMinimum(time2position(left)); // bound thumb
+	updateTooltipFormat();
 	setTime(m_time);
 }
 
@@ -103,23 +287,48 @@ void MTimelineSlider::setRightBound(qint64 right)
 	if (m_rightBound == right)
 		return;
 	m_rightBound = right;
+	clampVisibleRange();
 	defaultThumb()->setMaximum(time2position(right)); // bound thumb
+	updateTooltipFormat();
 	setTime(m_time);
 }
 
 void MTimelineSlider::setBoundingMode(BoundingMode mode)
 {
 	m_boundingMode = mode;
+	clampVisibleRange();
+	updateTooltipFormat();
 }
 
 void MTimelineSlider::setTime(qint64 time)
 {
+	// при масштабировании ручка упирается в край видимой части, поэтому время берётся из аргумента,
+	// а не восстанавливается по положению ручки
+	time = boundedTime(time);
+	if (time != m_time)
+	{
+		// как и в updateTime(), время меняется до valueChanged: обработчики value уже видят новое time()
+		m_time = time;
+		emit timeChanged(m_time);
+	}
+
+	m_silentMove = true; // updateTime() не должен пересчитывать время по обрезанному положению ручки
 	setValue(time2position(time));
+	m_silentMove = false;
 }
 
 void MTimelineSlider::mouseMoveEvent(QMouseEvent *event)
 {
-	QString timeFormat = "hh:mm:ss";
+	if (m_isPanning)
+	{
+		const int length = qMax(1, this->width() - 2*grooveOffset());
+		const qint64 span = visibleEnd() - visibleStart();
+		const qint64 start = m_panStartTime - static_cast<qint64>((event->pos().x() - m_panStartX) * static_cast<double>(span) / length);
+		setVisibleRange(start, start + span);
+		event->accept();
+		return;
+	}
+
 	int width = this->width() - 2*grooveOffset();
 	int posX = event->pos().x() - grooveOffset();
 	// считаем прогресс для данной позиции
@@ -130,40 +339,456 @@ void MTimelineSlider::mouseMoveEvent(QMouseEvent *event)
 	else if (posX < 0)
 		progressPercent = 0.0;
 
-	QTime time(0,0,0,0);
+	// время в подсказке отсчитывается от начала ограниченного диапазона
 	qint64 startOffset = ( m_boundingMode == FullSliderWidth ) ? 0 : boundsStartOffset();
-	time = time.addSecs( (startOffset + progressPercent * (endTimeBounded() - startTimeBounded())) / 1000LL );
+	startOffset += visibleStart() - boundsStartOffset();
+	qint64 time = startOffset + static_cast<qint64>(progressPercent * (visibleEnd() - visibleStart()));
+	time = time / TOOLTIP_PRECISION_MS * TOOLTIP_PRECISION_MS;
 
-	// Определяем какой формат представления времени подходит лучше всего.
-	if ( m_displayFormatList.size() > 0 )
+	QString tooltip;
+	if (!m_markers.isEmpty())
+	{
+		const qint64 tolerance = MARKER_HIT_TOLERANCE * (visibleEnd() - visibleStart()) / qMax(1, width);
+		const int index = m_markers.nearest(viewTimeAt(event->pos().x()), tolerance);
+		if (index >= 0)
+			tooltip = m_markers.at(index).label;
+	}
+	if (tooltip.isEmpty())
+		tooltip = formatTime(time, m_tooltipFormat);
+
+	QToolTip::showText(mapToGlobal( event->pos() ), tooltip, this, rect());
+
+	if (m_preview)
+		m_preview->showAt(mapToGlobal( event->pos() ), position2time( pointToValue( event->pos() ) ));
+
+	MSlider::mouseMoveEvent( event );
+}
+
+void MTimelineSlider::mousePressEvent(QMouseEvent *event)
+{
+	if (m_zoomEnabled && m_zoomed && event->button() == Qt::MiddleButton)
 	{
-		double  selectedError  = 1e300;
+		m_isPanning = true;
+		m_panStartX = event->pos().x();
+		m_panStartTime = visibleStart();
+		event->accept();
+		return;
+	}
 
-		QStringList::iterator I = m_displayFormatList.begin();
-		QStringList::iterator E = m_displayFormatList.end();
-		for ( ; I != E ; ++I )
+	MSlider::mousePressEvent( event );
+}
+
+void MTimelineSlider::mouseReleaseEvent(QMouseEvent *event)
+{
+	if (m_isPanning && event->button() == Qt::MiddleButton)
+	{
+		m_isPanning = false;
+		event->accept();
+		return;
+	}
+
+	MSlider::mouseReleaseEvent( event );
+}
+
+void MTimelineSlider::wheelEvent(QWheelEvent *event)
+{
+	if (!m_zoomEnabled || orientation() != Qt::Horizontal)
+	{
+		MSlider::wheelEvent( event );
+		return;
+	}
+
+	const QPoint delta = event->angleDelta();
+	if (event->modifiers() & Qt::ControlModifier)
+	{
+		zoom(viewTimeAt(event->pos().x()), std::pow(WHEEL_ZOOM_FACTOR, delta.y() / static_cast<double>(WHEEL_STEP)));
+		event->accept();
+		return;
+	}
+
+	if (m_zoomed && (delta.x() != 0 || (event->modifiers() & Qt::ShiftModifier)))
+	{
+		const int steps = delta.x() != 0 ? delta.x() : delta.y();
+		pan(static_cast<qint64>(-steps / static_cast<double>(WHEEL_STEP) * WHEEL_PAN_FRACTION * (visibleEnd() - visibleStart())));
+		event->accept();
+		return;
+	}
+
+	MSlider::wheelEvent( event );
+}
+
+bool MTimelineSlider::event(QEvent *event)
+{
+	if (m_zoomEnabled && event->type() == QEvent::NativeGesture)
+	{
+		QNativeGestureEvent *gesture = static_cast<QNativeGestureEvent *>(event);
+		if (gesture->gestureType() == Qt::ZoomNativeGesture && gesture->value() > -1.0)
 		{
-			QString visibleString = time.toString(*I);
-			QTime  visibleTime    = QTime::fromString( visibleString , *I );
-			double visibleError   = time.msecsTo( visibleTime );
+			zoom(viewTimeAt(static_cast<int>(gesture->localPos().x())), 1.0 / (1.0 + gesture->value()));
+			return true;
+		}
+	}
+
+	return MSlider::event( event );
+}
 
-			if (visibleError < 0 )
-				visibleError = -visibleError;
+void MTimelineSlider::paintEvent(QPaintEvent *event)
+{
+	MSlider::paintEvent( event );
 
-			if ( visibleError < selectedError )
-			{
-				timeFormat = *I;
-				selectedError  = visibleError;
-			}
+	if (m_waveform && m_waveform->isReady() && orientation() == Qt::Horizontal)
+	{
+		QPainter painter(this);
+		m_waveform->paint(painter, QRect(grooveOffset(), 0, width() - 2*grooveOffset(), height()), visibleStart(), visibleEnd());
+	}
+
+	if (orientation() == Qt::Horizontal)
+		paintMarkers();
+
+	if (m_rulerVisible && orientation() == Qt::Horizontal)
+		paintRuler();
+}
+
+void MTimelineSlider::changeEvent(QEvent *event)
+{
+	MSlider::changeEvent( event );
+
+	if (event->type() == QEvent::FontChange)
+		m_rulerLabels.clear();
+}
+
+void MTimelineSlider::leaveEvent(QEvent *event)
+{
+	if (m_preview)
+		m_preview->hide();
+
+	MSlider::leaveEvent( event );
+}
+
+void MTimelineSlider::hideEvent(QHideEvent *event)
+{
+	if (m_preview)
+		m_preview->hide();
+
+	MSlider::hideEvent( event );
+}
+
+MTimelinePreview& MTimelineSlider::preview()
+{
+	if (!m_preview)
+		m_preview = new MTimelinePreview(this);
+	return *m_preview;
+}
+
+MTimelineWaveform& MTimelineSlider::waveform()
+{
+	if (!m_waveform)
+	{
+		m_waveform = new MTimelineWaveform(this);
+		connect(m_waveform, &MTimelineWaveform::ready, this, [this]() { update(); });
+	}
+	return *m_waveform;
+}
+
+void MTimelineSlider::setVisibleRange(qint64 start, qint64 end)
+{
+	const qint64 fullStart = boundsStartOffset();
+	const qint64 fullSpan  = endTimeBounded() - startTimeBounded();
+	if (fullSpan <= 0)
+		return;
+
+	// одна позиция слайдера - не меньше миллисекунды
+	const qint64 minSpan = qMin<qint64>(fullSpan, maximum() - minimum());
+	const qint64 span    = qBound(minSpan, end - start, fullSpan);
+	start = qBound(fullStart, start, fullStart + fullSpan - span);
+
+	const bool zoomed = span < fullSpan;
+	if (zoomed == m_zoomed && (!zoomed || (start == m_visibleStart && start + span == m_visibleEnd)))
+		return;
+
+	m_zoomed = zoomed;
+	m_visibleStart = start;
+	m_visibleEnd = start + span;
+	applyVisibleRange();
+}
+
+void MTimelineSlider::resetZoom()
+{
+	if (!m_zoomed)
+		return;
+	m_zoomed = false;
+	applyVisibleRange();
+}
+
+void MTimelineSlider::zoom(qint64 anchorTime, double factor)
+{
+	const qint64 start = visibleStart();
+	const qint64 span  = visibleEnd() - start;
+	if (span <= 0 || factor <= 0)
+		return;
+
+	const double  anchorProgress = static_cast<double>(anchorTime - start) / span;
+	const qint64  newSpan        = qMax<qint64>(1, qRound64(span * factor));
+	const qint64  newStart       = anchorTime - qRound64(anchorProgress * newSpan);
+	setVisibleRange(newStart, newStart + newSpan);
+}
+
+void MTimelineSlider::pan(qint64 delta)
+{
+	if (!m_zoomed)
+		return;
+	setVisibleRange(m_visibleStart + delta, m_visibleEnd + delta);
+}
+
+qint64 MTimelineSlider::visibleStart() const
+{
+	return m_zoomed ? m_visibleStart : boundsStartOffset();
+}
+
+qint64 MTimelineSlider::visibleEnd() const
+{
+	return m_zoomed ? m_visibleEnd : boundsStartOffset() + (endTimeBounded() - startTimeBounded());
+}
+
+void MTimelineSlider::clampVisibleRange()
+{
+	if (!m_zoomed)
+		return;
+
+	const qint64 fullStart = boundsStartOffset();
+	const qint64 fullSpan  = endTimeBounded() - startTimeBounded();
+	const qint64 span      = m_visibleEnd - m_visibleStart;
+	if (fullSpan <= 0 || span >= fullSpan)
+	{
+		m_zoomed = false;
+		return;
+	}
+
+	m_visibleStart = qBound(fullStart, m_visibleStart, fullStart + fullSpan - span);
+	m_visibleEnd = m_visibleStart + span;
+}
+
+void MTimelineSlider::applyVisibleRange()
+{
+	m_silentMove = true;
+	{
+		if (m_leftBound >= 0)
+			defaultThumb()->setMinimum(time2position(m_leftBound));
+		else
+			defaultThumb()->setMinimum(minimum());
+		if (m_rightBound >= 0)
+			defaultThumb()->setMaximum(time2position(m_rightBound));
+		else
+			defaultThumb()->setMaximum(maximum());
+
+		setValue(time2position(m_time));
+	}
+	m_silentMove = false;
+
+	update();
+	emit visibleRangeChanged(visibleStart(), visibleEnd());
+}
+
+qint64 MTimelineSlider::viewTimeAt(int x)
+{
+	const int length = qMax(1, width() - 2*grooveOffset());
+	const double progress = qBound(0.0, static_cast<double>(x - grooveOffset()) / length, 1.0);
+	return visibleStart() + static_cast<qint64>(progress * (visibleEnd() - visibleStart()) + 0.5);
+}
+
+void MTimelineSlider::paintRuler()
+{
+	const int length = width() - 2*grooveOffset();
+	const qint64 start = visibleStart();
+	const qint64 end = visibleEnd();
+	if (length <= 0 || end <= start)
+		return;
+
+	const double pxPerMs = static_cast<double>(length) / (end - start);
+	const bool hasHours = endTimeBounded() - startTimeBounded() >= 3600000;
+
+	// мелкие деления - наименьший шаг, при котором они не сливаются
+	int minorIndex = 0;
+	while (minorIndex < RULER_STEP_COUNT - 1 && RULER_STEPS[minorIndex] * pxPerMs < RULER_MIN_TICK_SPACING)
+		++minorIndex;
+	const qint64 minorStep = RULER_STEPS[minorIndex];
+
+	// подписанные деления - наименьший кратный шаг, при котором подписи не перекрываются
+	const int labelWidth = fontMetrics().width(formatTime(end - boundsStartOffset(), rulerFormat(minorStep, hasHours))) + RULER_LABEL_PADDING;
+	int majorIndex = minorIndex;
+	while (majorIndex < RULER_STEP_COUNT - 1 && (RULER_STEPS[majorIndex] % minorStep != 0 || RULER_STEPS[majorIndex] * pxPerMs < labelWidth))
+		++majorIndex;
+	const qint64 majorStep = RULER_STEPS[majorIndex];
+	const QString format = rulerFormat(majorStep, hasHours);
+
+	// кэш подписей живёт, пока не меняется масштаб: при прокрутке подписи только сдвигаются
+	if (majorStep != m_rulerMajorStep || format != m_rulerFormat || m_rulerLabels.size() > RULER_LABEL_CACHE_LIMIT)
+	{
+		m_rulerLabels.clear();
+		m_rulerMajorStep = majorStep;
+		m_rulerFormat = format;
+	}
+
+	QPainter painter(this);
+	painter.setPen(palette().color(foregroundRole()));
+	painter.setFont(font());
+
+	const int bottom = height() - 1;
+	for (qint64 tick = ceilToStep(start, minorStep); tick <= end; tick += minorStep)
+	{
+		const int x = grooveOffset() + qRound((tick - start) * pxPerMs);
+		const bool isMajor = (tick % majorStep == 0);
+		painter.drawLine(x, bottom - (isMajor ? RULER_MAJOR_TICK : RULER_MINOR_TICK), x, bottom);
+		if (!isMajor)
+			continue;
+
+		auto label = m_rulerLabels.find(tick);
+		if (label == m_rulerLabels.end())
+		{
+			QStaticText text(formatTime(tick - boundsStartOffset(), format));
+			text.setPerformanceHint(QStaticText::AggressiveCaching);
+			text.prepare(QTransform(), font());
+			label = m_rulerLabels.insert(tick, text);
+		}
+		painter.drawStaticText(QPointF(x + 2, bottom - RULER_MAJOR_TICK - label->size().height()), *label);
+	}
+}
+
+void MTimelineSlider::setMarkers(const QVector<MTimelineMarker> & markers)
+{
+	m_markers.setMarkers(markers);
+	update();
+}
+
+void MTimelineSlider::paintMarkers()
+{
+	const int length = width() - 2*grooveOffset();
+	const qint64 start = visibleStart();
+	const qint64 end = visibleEnd();
+	if (m_markers.isEmpty() || length <= 0 || end <= start)
+		return;
+
+	m_visibleMarkers.clear();
+	m_markers.query(start, end, m_visibleMarkers);
+
+	const double pxPerMs = static_cast<double>(length) / (end - start);
+	const QColor defaultColor = palette().color(QPalette::Highlight);
+
+	QPainter painter(this);
+	int lastLineX = INT_MIN;
+	for (int index : m_visibleMarkers)
+	{
+		const MTimelineMarker & marker = m_markers.at(index);
+		const QColor color = marker.color.isValid() ? marker.color : defaultColor;
+
+		if (marker.duration > 0)
+		{
+			const double from = grooveOffset() + (qMax(marker.time, start) - start) * pxPerMs;
+			const double to   = grooveOffset() + (qMin(marker.endTime(), end) - start) * pxPerMs;
+			QColor fill = color;
+			fill.setAlpha(CHAPTER_ALPHA);
+			painter.fillRect(QRectF(from, 0, qMax(1.0, to - from), MARKER_STRIP_HEIGHT), fill);
 		}
+
+		if (marker.time < start)
+			continue;
+
+		// маркеры отсортированы по началу: несколько маркеров в одном пикселе рисуются одной линией
+		const int x = grooveOffset() + qRound((marker.time - start) * pxPerMs);
+		if (x == lastLineX)
+			continue;
+		lastLineX = x;
+
+		painter.setPen(color);
+		painter.drawLine(x, 0, x, height());
 	}
+}
 
-	QToolTip::showText(mapToGlobal( event->pos() ), time.toString( timeFormat ), this, rect());
+void MTimelineSlider::setFollowSource(std::shared_ptr<MPlayheadFeed> feed)
+{
+	m_followSource = std::move(feed);
 
-	MSlider::mouseMoveEvent( event );
+	if (!m_followSource)
+	{
+		if (m_followTimer)
+			m_followTimer->stop();
+		return;
+	}
+
+	if (!m_followTimer)
+	{
+		m_followTimer = new QTimer(this);
+		m_followTimer->setTimerType(Qt::PreciseTimer);
+		m_followTimer->setInterval(FOLLOW_INTERVAL);
+		connect(m_followTimer, &QTimer::timeout, this, &MTimelineSlider::followSourceTick);
+	}
+	m_followTimer->start();
+	followSourceTick();
 }
 
-int MTimelineSlider::time2position(qint64 time) const
+void MTimelineSlider::followSourceTick()
+{
+	// пока пользователь тащит ручку, позицией управляет он, и timeChanged испускается как обычно
+	if (!m_followSource || isSliderDown())
+		return;
+
+	// источник может выйти за диапазон слайдера, а time() не должно сообщать то, чего не допустил бы setTime
+	const qint64 time = boundedTime(m_followSource->time());
+	if (time == m_time)
+		return;
+	m_time = time; // time() остаётся точным, даже если ручка не сдвинется
+
+	const int position = time2position(time);
+	if (position == value() || positionToPixel(position) == positionToPixel(value()))
+		return;
+
+	m_silentMove = true;
+	setValue(position);
+	m_silentMove = false;
+}
+
+int MTimelineSlider::positionToPixel(int position)
+{
+	double range = maximum() - minimum();
+	if (range == 0)
+		range = 1;
+	return static_cast<int>(((width() - 2.0 * grooveOffset()) * position / range) + 0.5);
+}
+
+void MTimelineSlider::updateTooltipFormat()
+{
+	m_tooltipFormat = DEFAULT_TOOLTIP_FORMAT;
+	if ( m_displayFormatList.isEmpty() )
+		return;
+
+	// Лучший формат зависит только от диапазона: хуже всего представимо максимальное время,
+	// на нём проявляется нехватка старших разрядов, а младшие ограничены точностью подсказки.
+	qint64 startOffset = ( m_boundingMode == FullSliderWidth ) ? 0 : boundsStartOffset();
+	qint64 maxTime = startOffset + (endTimeBounded() - startTimeBounded());
+	maxTime = maxTime / TOOLTIP_PRECISION_MS * TOOLTIP_PRECISION_MS;
+
+	QTime time = QTime(0,0,0,0).addMSecs( maxTime );
+
+	// Определяем какой формат представления времени подходит лучше всего.
+	double selectedError = 1e300;
+	for ( const QString & format : m_displayFormatList )
+	{
+		QString visibleString = time.toString( format );
+		QTime  visibleTime    = QTime::fromString( visibleString , format );
+		double visibleError   = time.msecsTo( visibleTime );
+
+		if (visibleError < 0 )
+			visibleError = -visibleError;
+
+		if ( visibleError < selectedError )
+		{
+			m_tooltipFormat = format;
+			selectedError   = visibleError;
+		}
+	}
+}
+
+qint64 MTimelineSlider::boundedTime(qint64 time) const
 {
 	// учёт ограничений на значение времени
 	time = qBound(m_startTime, time, m_endTime);
@@ -175,13 +800,18 @@ int MTimelineSlider::time2position(qint64 time) const
 		time = qMax(m_leftBound, time);
 	if (m_rightBound >= 0)
 		time = qMin(time, m_rightBound);
+	return time;
+}
 
-	time -= boundsStartOffset();
-	const qint64 deltaTimeBounded = endTimeBounded() - startTimeBounded();
-	if (deltaTimeBounded == 0)
+int MTimelineSlider::time2position(qint64 time) const
+{
+	time = boundedTime(time) - visibleStart();
+	const qint64 deltaTimeVisible = visibleEnd() - visibleStart();
+	if (deltaTimeVisible == 0)
 		return 0;
 
-	const double progress = static_cast<double>(time) / deltaTimeBounded;
+	// при масштабировании время может оказаться за пределами видимой части
+	const double progress = qBound(0.0, static_cast<double>(time) / deltaTimeVisible, 1.0);
 	return static_cast<int>(progress * (maximum() - minimum()) + 0.5);
 }
 
@@ -191,13 +821,13 @@ qint64 MTimelineSlider::position2time(int pos) const
 	pos = qBound(minimum(), pos, maximum());
 
 	// учёт bound-ограничений
-	if (m_leftBound >= 0 && pos == defaultThumb()->minimum()) // handle on its minimum value
+	if (m_leftBound >= 0 && pos == defaultThumb()->minimum() && m_leftBound >= visibleStart()) // handle on its minimum value
 		return m_leftBound;
-	if (m_rightBound >= 0 && pos == defaultThumb()->maximum()) // handle on its maximum value
+	if (m_rightBound >= 0 && pos == defaultThumb()->maximum() && m_rightBound <= visibleEnd()) // handle on its maximum value
 		return m_rightBound;
 
 	double progress = static_cast<double>(pos)/(maximum() - minimum());
-	return boundsStartOffset() + static_cast<qint64>(progress * (endTimeBounded() - startTimeBounded()) + 0.5);
+	return visibleStart() + static_cast<qint64>(progress * (visibleEnd() - visibleStart()) + 0.5);
 }
 
 qint64 MTimelineSlider::startTimeBounded() const
@@ -225,6 +855,9 @@ void MTimelineSlider::reset()
 
 void MTimelineSlider::updateTime(int value)
 {
+	if (m_silentMove)
+		return;
+
 	qint64 time = position2time(value);
 	if (time == m_time)
 		return;
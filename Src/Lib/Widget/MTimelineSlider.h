@@ -1,9 +1,20 @@
 #pragma once
 
+#include <memory>
+
+#include <QHash>
+#include <QStaticText>
+
 #include "MSlider.h"
+#include "MTimelineMarkers.h"
 
 #include "MovaviWidgetLib.h"
 
+class MTimelinePreview;
+class MTimelineWaveform;
+class MPlayheadFeed;
+class QTimer;
+
 /**
  * @class MTimelineSlider
  * @brief Элемент управления: слайдер с отображением временной позиции под курсором и с возможностями MSlider
@@ -18,6 +29,12 @@
  * 0       40%             1
  * |--------|--------------|
  * S        T              E
+ *
+ * Шкалу можно масштабировать: setVisibleRange() задаёт видимую часть [visibleStart, visibleEnd], на которую
+ * отображается вся градация слайдера, поэтому точность позиционирования растёт вместе с масштабом.
+ * При включённом zoomEnabled масштаб меняется колесом мыши с Ctrl или жестом, а видимая часть сдвигается
+ * перетаскиванием средней кнопкой мыши либо колесом с Shift. rulerVisible включает линейку с делениями,
+ * плотность которых подстраивается под масштаб.
  */
 class MOVAVIWIDGET_API MTimelineSlider : public MSlider
 {
@@ -40,6 +57,10 @@ private:
 	Q_PROPERTY(QString styleTag					READ styleTag			WRITE setStyleTag )
 	/*Свойство, задающее форматы для отображения данных.*/
 	Q_PROPERTY(QStringList displayFormatList	READ displayFormatList	WRITE setDisplayFormatList )
+	/*Свойство, включающее масштабирование и прокрутку шкалы мышью.*/
+	Q_PROPERTY(bool zoomEnabled					READ zoomEnabled		WRITE setZoomEnabled )
+	/*Свойство, включающее отображение линейки с делениями.*/
+	Q_PROPERTY(bool rulerVisible				READ rulerVisible		WRITE setRulerVisible )
 
 public:
 	MTimelineSlider(QWidget *parent = 0);
@@ -51,6 +72,12 @@ public:
 	void setStyleTag          ( const QString & );
 	void setDisplayFormatList ( const QStringList & );
 
+	bool zoomEnabled() const  { return m_zoomEnabled; }
+	bool rulerVisible() const { return m_rulerVisible; }
+
+	void setZoomEnabled  ( bool );
+	void setRulerVisible ( bool );
+
 	/// @name Установка регулируемых значений @{
 	void setTimeRange(qint64, qint64);
 	void setStartTime(qint64);
@@ -77,19 +104,80 @@ public:
 	qint64 position2time(int pos) const;
 	/// Преобразовывает временную метку в положение слайдера
 	int time2position(qint64 time) const;
+	/// Ограничивает временную метку диапазоном [startTime, endTime] и bound-ограничениями
+	qint64 boundedTime(qint64 time) const;
 	/// Сброс позиции на 0 без испускания сигнала.
 	void reset();
 
+	/// @name Масштабирование шкалы @{
+	void setVisibleRange(qint64 start, qint64 end); ///< Видимая часть шкалы, ограничивается полным диапазоном
+	void resetZoom();                               ///< Показать всю шкалу
+	void zoom(qint64 anchorTime, double factor);    ///< factor < 1 - приближение; anchorTime остаётся на месте
+	void pan(qint64 delta);                         ///< Сдвиг видимой части на delta миллисекунд
+
+	qint64 visibleStart() const;
+	qint64 visibleEnd() const;
+	bool isZoomed() const { return m_zoomed; }
+	/// @}
+
+	/// @brief Возвращает всплывающее превью кадра под курсором
+	/// @note Создаётся при первом обращении; превью показывается только после установки MTimelinePreview::setProvider()
+	MTimelinePreview& preview();
+
+	/// @brief Возвращает осциллограмму, рисуемую под ручками слайдера
+	/// @note Создаётся при первом обращении; рисуется после того, как MTimelineWaveform построит пирамиду
+	MTimelineWaveform& waveform();
+
+	/// @name Маркеры и главы @{
+	/// Маркеры рисуются на шкале, при наведении на маркер подсказка показывает его label вместо времени
+	void setMarkers(const QVector<MTimelineMarker> & markers);
+	const MTimelineMarkers & markers() const { return m_markers; }
+	/// @}
+
+	/// @name Следование за источником позиции @{
+	/// Раз в кадр слайдер считывает время из @a feed и двигает ручку, только если сменился пиксель.
+	/// timeChanged при этом не испускается; пока пользователь тащит ручку, следование приостанавливается.
+	/// nullptr выключает режим.
+	void setFollowSource(std::shared_ptr<MPlayheadFeed> feed);
+	std::shared_ptr<MPlayheadFeed> followSource() const { return m_followSource; }
+	bool isFollowing() const { return m_followSource != nullptr; }
+	/// @}
+
 private:
+	/// Подбирает формат подсказки под текущий диапазон времени (вызывается при изменении диапазона, границ или списка форматов)
+	void updateTooltipFormat();
+
+	/// Ограничивает видимую часть шкалы полным диапазоном (после изменения диапазона или границ)
+	void clampVisibleRange();
+	/// Пересчитывает положение ручки под новую видимую часть шкалы, не меняя time()
+	void applyVisibleRange();
+	/// Время, соответствующее точке x видимой части шкалы
+	qint64 viewTimeAt(int x);
+
+	void paintRuler();
+	void paintMarkers();
+
+	/// Пиксельное смещение ручки для позиции слайдера (как в MSlider::moveThumbTo)
+	int positionToPixel(int position);
+
 	inline qint64 startTimeBounded() const;
 	inline qint64 endTimeBounded() const;
 	inline qint64 boundsStartOffset() const;
 
 protected:
-	void mouseMoveEvent(QMouseEvent *event);
+	bool event(QEvent *event) override;
+	void mousePressEvent(QMouseEvent *event) override;
+	void mouseReleaseEvent(QMouseEvent *event) override;
+	void mouseMoveEvent(QMouseEvent *event) override;
+	void wheelEvent(QWheelEvent *event) override;
+	void paintEvent(QPaintEvent *event) override;
+	void changeEvent(QEvent *event) override;
+	void leaveEvent(QEvent *event) override;
+	void hideEvent(QHideEvent *event) override;
 
 signals:
 	void timeChanged(qint64);
+	void visibleRangeChanged(qint64 start, qint64 end);
 
 private slots:
 	/**
@@ -99,6 +187,9 @@ private slots:
 	  */
 	void updateTime(int value);
 
+	/// Считывает время из источника и сдвигает ручку (по таймеру в режиме следования)
+	void followSourceTick();
+
 private:
 	qint64 m_startTime;
 	qint64 m_endTime;
@@ -108,4 +199,28 @@ private:
 	BoundingMode m_boundingMode;
 	QString m_styleTag;
 	QStringList m_displayFormatList;
+	QString m_tooltipFormat; ///< формат, выбранный из m_displayFormatList для текущего диапазона
+	MTimelinePreview *m_preview; ///< создаётся только в случае, когда пользователь запросил preview()
+	MTimelineWaveform *m_waveform; ///< создаётся только в случае, когда пользователь запросил waveform()
+
+	MTimelineMarkers m_markers;
+	QVector<int>     m_visibleMarkers; ///< буфер для результатов поиска, чтобы не выделять память при каждой отрисовке
+
+	std::shared_ptr<MPlayheadFeed> m_followSource;
+	QTimer *m_followTimer; ///< создаётся при первом включении режима следования
+
+	bool   m_zoomEnabled;
+	bool   m_zoomed;       ///< если false, видимая часть совпадает с полным диапазоном
+	qint64 m_visibleStart;
+	qint64 m_visibleEnd;
+	bool   m_silentMove;   ///< ручка двигается без пересчёта time() и без timeChanged (смена видимой части, следование за источником)
+
+	bool   m_isPanning;
+	int    m_panStartX;
+	qint64 m_panStartTime;
+
+	bool    m_rulerVisible;
+	qint64  m_rulerMajorStep;              ///< шаг подписанных делений, для которого заполнен кэш подписей
+	QString m_rulerFormat;
+	QHash<qint64, QStaticText> m_rulerLabels; ///< подписи текущего масштаба; при прокрутке только сдвигаются
 };
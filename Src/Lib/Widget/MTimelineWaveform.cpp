@@ -0,0 +1,352 @@
+#include "MTimelineWaveform.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <QLineF>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPainter>
+#include <QRunnable>
+#include <QThreadPool>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define MTIMELINEWAVEFORM_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+const int BASE_BLOCK_SIZE = 64; // отсчётов в блоке нижнего уровня пирамиды
+
+struct Level
+{
+	qint64 blockSize = 0; // отсчётов исходного сигнала в одном элементе уровня
+	QVector<float> mins;
+	QVector<float> maxs;
+};
+
+struct Pyramid
+{
+	int sampleRate = 0;
+	QVector<float> samples; // исходные отсчёты нужны при сильном приближении, когда блок нижнего уровня шире пикселя
+	QVector<Level> levels;  // от мелкого к грубому
+};
+
+void blockMinMax(const float * data, int count, float & outMin, float & outMax)
+{
+	int i = 0;
+	float lo = data[0];
+	float hi = data[0];
+#ifdef MTIMELINEWAVEFORM_SSE
+	if (count >= 4)
+	{
+		__m128 vmin = _mm_loadu_ps(data);
+		__m128 vmax = vmin;
+		for (i = 4; i + 4 <= count; i += 4)
+		{
+			const __m128 v = _mm_loadu_ps(data + i);
+			vmin = _mm_min_ps(vmin, v);
+			vmax = _mm_max_ps(vmax, v);
+		}
+
+		float mins[4], maxs[4];
+		_mm_storeu_ps(mins, vmin);
+		_mm_storeu_ps(maxs, vmax);
+		lo = std::min(std::min(mins[0], mins[1]), std::min(mins[2], mins[3]));
+		hi = std::max(std::max(maxs[0], maxs[1]), std::max(maxs[2], maxs[3]));
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		lo = std::min(lo, data[i]);
+		hi = std::max(hi, data[i]);
+	}
+	outMin = lo;
+	outMax = hi;
+}
+
+/// Сворачивает соседние пары: out[i] = min/max(in[2i], in[2i+1]); непарный последний элемент переносится как есть
+void reducePairs(const float * in, int count, float * out, bool takeMax)
+{
+	const int pairs = count / 2;
+	int i = 0;
+#ifdef MTIMELINEWAVEFORM_SSE
+	for (; i + 4 <= pairs; i += 4)
+	{
+		const __m128 a    = _mm_loadu_ps(in + 2*i);
+		const __m128 b    = _mm_loadu_ps(in + 2*i + 4);
+		const __m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 odd  = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(out + i, takeMax ? _mm_max_ps(even, odd) : _mm_min_ps(even, odd));
+	}
+#endif
+	for (; i < pairs; ++i)
+		out[i] = takeMax ? std::max(in[2*i], in[2*i + 1]) : std::min(in[2*i], in[2*i + 1]);
+	if (count % 2)
+		out[pairs] = in[count - 1];
+}
+
+std::shared_ptr<const Pyramid> buildPyramid(QVector<float> samples, int sampleRate, const std::atomic<bool> & cancelled)
+{
+	auto pyramid = std::make_shared<Pyramid>();
+	pyramid->sampleRate = sampleRate;
+	pyramid->samples = std::move(samples);
+
+	const int count = pyramid->samples.size();
+	if (count == 0)
+		return pyramid;
+
+	Level base;
+	base.blockSize = BASE_BLOCK_SIZE;
+	const int blocks = (count + BASE_BLOCK_SIZE - 1) / BASE_BLOCK_SIZE;
+	base.mins.resize(blocks);
+	base.maxs.resize(blocks);
+
+	const float * data = pyramid->samples.constData();
+	float * mins = base.mins.data();
+	float * maxs = base.maxs.data();
+	for (int block = 0; block < blocks; ++block)
+	{
+		if (cancelled)
+			return nullptr;
+		const int first = block * BASE_BLOCK_SIZE;
+		blockMinMax(data + first, std::min(BASE_BLOCK_SIZE, count - first), mins[block], maxs[block]);
+	}
+	pyramid->levels.append(base);
+
+	while (pyramid->levels.last().mins.size() > 1)
+	{
+		if (cancelled)
+			return nullptr;
+
+		const Level & previous = pyramid->levels.last();
+		const int size = previous.mins.size();
+
+		Level next;
+		next.blockSize = previous.blockSize * 2;
+		next.mins.resize((size + 1) / 2);
+		next.maxs.resize((size + 1) / 2);
+		reducePairs(previous.mins.constData(), size, next.mins.data(), false);
+		reducePairs(previous.maxs.constData(), size, next.maxs.data(), true);
+
+		pyramid->levels.append(next);
+	}
+
+	return pyramid;
+}
+
+/// Результат построения передаётся в GUI-поток через это состояние: задача пула обращается к нему под мьютексом,
+/// поэтому устаревшие (generation) или адресованные уже удалённому объекту пирамиды отбрасываются.
+struct BuildState
+{
+	QMutex mutex;
+	QObject * receiver = nullptr;
+	int generation = 0;
+	std::shared_ptr<const Pyramid> result;
+};
+
+class BuildTask : public QRunnable
+{
+public:
+	BuildTask(std::shared_ptr<BuildState> state, int generation, std::shared_ptr<std::atomic<bool>> cancelled,
+		QVector<float> samples, int sampleRate, std::shared_ptr<MTimelineWaveformProvider> provider)
+		: m_state(std::move(state))
+		, m_generation(generation)
+		, m_cancelled(std::move(cancelled))
+		, m_samples(std::move(samples))
+		, m_sampleRate(sampleRate)
+		, m_provider(std::move(provider))
+	{ }
+
+	void run() override
+	{
+		if (*m_cancelled)
+			return;
+
+		if (m_provider)
+		{
+			m_sampleRate = m_provider->sampleRate();
+			m_samples = m_provider->samples(*m_cancelled);
+		}
+
+		auto pyramid = buildPyramid(std::move(m_samples), m_sampleRate, *m_cancelled);
+		if (!pyramid)
+			return;
+
+		QMutexLocker locker(&m_state->mutex);
+		if (!m_state->receiver || m_state->generation != m_generation)
+			return;
+		m_state->result = std::move(pyramid);
+		QMetaObject::invokeMethod(m_state->receiver, "buildFinished", Qt::QueuedConnection);
+	}
+
+private:
+	std::shared_ptr<BuildState>        m_state;
+	int                                m_generation;
+	std::shared_ptr<std::atomic<bool>> m_cancelled;
+	QVector<float>                     m_samples;
+	int                                m_sampleRate;
+	std::shared_ptr<MTimelineWaveformProvider> m_provider;
+};
+
+} // namespace
+
+struct MTimelineWaveform::Impl
+{
+	Impl(MTimelineWaveform * waveform)
+		: state(std::make_shared<BuildState>())
+	{
+		state->receiver = waveform;
+	}
+
+	~Impl()
+	{
+		cancel();
+		QMutexLocker locker(&state->mutex);
+		state->receiver = nullptr;
+	}
+
+	void cancel()
+	{
+		if (cancelled)
+			*cancelled = true;
+		cancelled.reset();
+		pyramid.reset();
+
+		QMutexLocker locker(&state->mutex);
+		++state->generation;
+		state->result.reset();
+	}
+
+	void start(QVector<float> samples, int sampleRate, std::shared_ptr<MTimelineWaveformProvider> provider, qint64 newStartTime)
+	{
+		cancel();
+		startTime = newStartTime;
+		cancelled = std::make_shared<std::atomic<bool>>(false);
+
+		int generation = 0;
+		{
+			QMutexLocker locker(&state->mutex);
+			generation = state->generation;
+		}
+		QThreadPool::globalInstance()->start(new BuildTask(state, generation, cancelled, std::move(samples), sampleRate, std::move(provider)));
+	}
+
+	std::shared_ptr<BuildState>        state;
+	std::shared_ptr<std::atomic<bool>> cancelled;
+	std::shared_ptr<const Pyramid>     pyramid;
+
+	qint64 startTime = 0;
+	QColor color = QColor(128, 128, 128, 128);
+};
+
+MTimelineWaveform::MTimelineWaveform(QObject * parent)
+	: QObject(parent)
+	, m_impl(new Impl(this))
+{ }
+
+MTimelineWaveform::~MTimelineWaveform() = default;
+
+void MTimelineWaveform::setSamples(QVector<float> samples, int sampleRate, qint64 startTime)
+{
+	m_impl->start(std::move(samples), sampleRate, nullptr, startTime);
+}
+
+void MTimelineWaveform::setProvider(std::shared_ptr<MTimelineWaveformProvider> provider, qint64 startTime)
+{
+	if (!provider)
+	{
+		clear();
+		return;
+	}
+	m_impl->start(QVector<float>(), 0, std::move(provider), startTime);
+}
+
+void MTimelineWaveform::clear()
+{
+	m_impl->cancel();
+}
+
+bool MTimelineWaveform::isReady() const
+{
+	return m_impl->pyramid != nullptr;
+}
+
+QColor MTimelineWaveform::color() const
+{
+	return m_impl->color;
+}
+
+void MTimelineWaveform::setColor(const QColor & color)
+{
+	m_impl->color = color;
+}
+
+void MTimelineWaveform::paint(QPainter & painter, const QRect & rect, qint64 visibleStart, qint64 visibleEnd) const
+{
+	const auto pyramid = m_impl->pyramid;
+	if (!pyramid || pyramid->samples.isEmpty() || pyramid->sampleRate <= 0 || rect.width() <= 0 || visibleEnd <= visibleStart)
+		return;
+
+	const double samplesPerMs    = pyramid->sampleRate / 1000.0;
+	const double firstSample     = (visibleStart - m_impl->startTime) * samplesPerMs;
+	const double samplesPerPixel = (visibleEnd - visibleStart) * samplesPerMs / rect.width();
+
+	// самый грубый уровень, у которого на пиксель приходится хотя бы один элемент
+	const Level * level = nullptr;
+	for (const Level & candidate : pyramid->levels)
+	{
+		if (candidate.blockSize > samplesPerPixel)
+			break;
+		level = &candidate;
+	}
+
+	const double  unitSize      = level ? static_cast<double>(level->blockSize) : 1.0;
+	const qint64  unitCount     = level ? level->mins.size() : pyramid->samples.size();
+	const float * mins          = level ? level->mins.constData() : pyramid->samples.constData();
+	const float * maxs          = level ? level->maxs.constData() : pyramid->samples.constData();
+	const double  firstUnit     = firstSample / unitSize;
+	const double  unitsPerPixel = samplesPerPixel / unitSize;
+
+	const double center     = rect.top() + rect.height() / 2.0;
+	const double halfHeight = rect.height() / 2.0;
+
+	QVector<QLineF> lines;
+	lines.reserve(rect.width());
+	for (int x = 0; x < rect.width(); ++x)
+	{
+		const qint64 from = std::max<qint64>(0, static_cast<qint64>(std::floor(firstUnit + x * unitsPerPixel)));
+		const qint64 to   = std::min<qint64>(unitCount, std::max<qint64>(from + 1, static_cast<qint64>(std::ceil(firstUnit + (x + 1) * unitsPerPixel))));
+		if (from >= to)
+			continue;
+
+		float lo = mins[from];
+		float hi = maxs[from];
+		for (qint64 i = from + 1; i < to; ++i)
+		{
+			lo = std::min(lo, mins[i]);
+			hi = std::max(hi, maxs[i]);
+		}
+
+		const double px = rect.left() + x + 0.5;
+		lines.append(QLineF(px, center - hi * halfHeight, px, center - lo * halfHeight));
+	}
+
+	painter.save();
+	painter.setPen(QPen(m_impl->color, 1));
+	painter.drawLines(lines);
+	painter.restore();
+}
+
+void MTimelineWaveform::buildFinished()
+{
+	{
+		QMutexLocker locker(&m_impl->state->mutex);
+		if (!m_impl->state->result)
+			return;
+		m_impl->pyramid = std::move(m_impl->state->result);
+		m_impl->state->result.reset();
+	}
+	emit ready();
+}
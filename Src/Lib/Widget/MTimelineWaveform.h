@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include <QColor>
+#include <QObject>
+#include <QScopedPointer>
+#include <QVector>
+
+#include "MovaviWidgetLib.h"
+
+class QPainter;
+class QRect;
+
+/// @class MTimelineWaveformProvider
+/// @brief Источник отсчётов звука для MTimelineWaveform
+class MOVAVIWIDGET_API MTimelineWaveformProvider
+{
+public:
+	virtual ~MTimelineWaveformProvider() {}
+
+	/// @brief Частота дискретизации отсчётов, возвращаемых samples()
+	virtual int sampleRate() const = 0;
+
+	/// @brief Возвращает моно-отсчёты в диапазоне [-1, 1]
+	/// @note Вызывается в потоке пула, а не в GUI-потоке. Долгие реализации должны периодически
+	/// проверять @a cancelled и прерываться, если отсчёты больше не нужны.
+	virtual QVector<float> samples(const std::atomic<bool> & cancelled) = 0;
+};
+
+/// @class MTimelineWaveform
+/// @brief Обзорная осциллограмма звука для отрисовки под MTimelineSlider
+/// @details По отсчётам один раз в пуле потоков строится пирамида минимумов/максимумов: каждый следующий
+/// уровень вдвое грубее предыдущего. При отрисовке выбирается уровень, соответствующий числу отсчётов
+/// на пиксель, поэтому стоимость paint() зависит от ширины, а не от длины клипа.
+/// Пока пирамида строится, isReady() возвращает false и paint() ничего не рисует.
+class MOVAVIWIDGET_API MTimelineWaveform : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit MTimelineWaveform(QObject * parent = nullptr);
+	~MTimelineWaveform();
+
+	/// @brief Задаёт отсчёты напрямую; @a startTime - время (в миллисекундах) первого отсчёта на шкале
+	void setSamples(QVector<float> samples, int sampleRate, qint64 startTime = 0);
+	/// @brief Задаёт источник отсчётов, которые будут запрошены в пуле потоков
+	void setProvider(std::shared_ptr<MTimelineWaveformProvider> provider, qint64 startTime = 0);
+	/// @brief Удаляет осциллограмму и отменяет незавершённое построение
+	void clear();
+
+	bool isReady() const;
+
+	QColor color() const;
+	void setColor(const QColor & color);
+
+	/// @brief Рисует часть осциллограммы, попадающую в [visibleStart, visibleEnd], в прямоугольник @a rect
+	void paint(QPainter & painter, const QRect & rect, qint64 visibleStart, qint64 visibleEnd) const;
+
+signals:
+	void ready(); ///< пирамида построена, осциллограмму можно рисовать
+
+private slots:
+	void buildFinished();
+
+private:
+	struct Impl;
+	QScopedPointer<Impl> m_impl;
+};
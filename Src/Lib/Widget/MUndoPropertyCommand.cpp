@@ -0,0 +1,170 @@
+#include "MUndoPropertyCommand.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+
+#include <QImage>
+
+namespace {
+
+const int DELTA_MIN_SIZE = 256; // меньшие значения дешевле хранить целиком
+
+qint64 payloadSize(const QVariant & value)
+{
+	switch (value.userType())
+	{
+	case QMetaType::QByteArray: return value.toByteArray().size();
+	case QMetaType::QString:    return value.toString().size() * qint64(sizeof(QChar));
+	case QMetaType::QImage:     return value.value<QImage>().byteCount();
+	default:                    return 0;
+	}
+}
+
+/// Длины общего начала и общего конца двух массивов; в сумме не больше длины более короткого
+void commonAffixes(const char * a, int aSize, const char * b, int bSize, int & prefix, int & suffix)
+{
+	const int limit = qMin(aSize, bSize);
+	prefix = int(std::mismatch(a, a + limit, b).first - a);
+
+	const auto aEnd = std::reverse_iterator<const char *>(a + aSize);
+	const auto bEnd = std::reverse_iterator<const char *>(b + bSize);
+	suffix = int(std::mismatch(aEnd, aEnd + (limit - prefix), bEnd).first - aEnd);
+}
+
+/// Байты изображения, если по ним можно строить разность: одинаковые размер, формат и длина строки
+bool comparableImages(const QImage & a, const QImage & b)
+{
+	return !a.isNull() && a.size() == b.size() && a.format() == b.format() && a.bytesPerLine() == b.bytesPerLine();
+}
+
+} // namespace
+
+MUndoPropertyCommand::MUndoPropertyCommand(MUndoPropertyTarget * target, quint64 objectId, int propertyId,
+	const QVariant & oldValue, const QVariant & newValue, QUndoCommand * parent)
+	: QUndoCommand(parent)
+	, m_target(target)
+	, m_objectId(objectId)
+	, m_propertyId(propertyId)
+	, m_newValue(newValue)
+{
+	assert(target);
+	setOldValue(oldValue);
+}
+
+QVariant MUndoPropertyCommand::oldValue() const
+{
+	if (!m_oldIsDelta)
+		return m_oldValue;
+
+	if (m_newValue.userType() == QMetaType::QImage)
+	{
+		QImage image = m_newValue.value<QImage>();
+		uchar * bits = image.bits(); // отсоединяет копию с той же раскладкой строк
+		std::memcpy(bits + m_deltaPrefix, m_oldMiddle.constData(), m_oldMiddle.size());
+		return image;
+	}
+
+	const QByteArray newBytes = m_newValue.toByteArray();
+	QByteArray bytes;
+	bytes.reserve(m_deltaPrefix + m_oldMiddle.size() + m_deltaSuffix);
+	bytes.append(newBytes.constData(), m_deltaPrefix);
+	bytes.append(m_oldMiddle);
+	bytes.append(newBytes.constData() + newBytes.size() - m_deltaSuffix, m_deltaSuffix);
+	return bytes;
+}
+
+void MUndoPropertyCommand::setOldValue(const QVariant & oldValue)
+{
+	m_oldValue = QVariant();
+	m_oldMiddle.clear();
+	m_deltaPrefix = m_deltaSuffix = 0;
+	m_oldIsDelta = false;
+
+	const qint64 size = payloadSize(oldValue);
+	if (size < DELTA_MIN_SIZE || oldValue.userType() != m_newValue.userType())
+	{
+		m_oldValue = oldValue;
+		return;
+	}
+
+	int prefix = 0;
+	int suffix = 0;
+	QByteArray middle;
+	if (oldValue.userType() == QMetaType::QByteArray)
+	{
+		const QByteArray oldBytes = oldValue.toByteArray();
+		const QByteArray newBytes = m_newValue.toByteArray();
+		commonAffixes(oldBytes.constData(), oldBytes.size(), newBytes.constData(), newBytes.size(), prefix, suffix);
+		middle = oldBytes.mid(prefix, oldBytes.size() - prefix - suffix);
+	}
+	else if (oldValue.userType() == QMetaType::QImage)
+	{
+		const QImage oldImage = oldValue.value<QImage>();
+		const QImage newImage = m_newValue.value<QImage>();
+		if (!comparableImages(oldImage, newImage))
+		{
+			m_oldValue = oldValue;
+			return;
+		}
+		auto oldBits = reinterpret_cast<const char *>(oldImage.constBits());
+		auto newBits = reinterpret_cast<const char *>(newImage.constBits());
+		commonAffixes(oldBits, oldImage.byteCount(), newBits, newImage.byteCount(), prefix, suffix);
+		middle = QByteArray(oldBits + prefix, oldImage.byteCount() - prefix - suffix);
+	}
+	else
+	{
+		m_oldValue = oldValue;
+		return;
+	}
+
+	// разность имеет смысл, только если она заметно меньше самого значения
+	if (middle.size() > size / 2)
+	{
+		m_oldValue = oldValue;
+		return;
+	}
+
+	m_oldMiddle   = middle;
+	m_deltaPrefix = prefix;
+	m_deltaSuffix = suffix;
+	m_oldIsDelta  = true;
+}
+
+void MUndoPropertyCommand::undo()
+{
+	m_target->setUndoProperty(m_objectId, m_propertyId, oldValue());
+}
+
+void MUndoPropertyCommand::redo()
+{
+	m_target->setUndoProperty(m_objectId, m_propertyId, m_newValue);
+}
+
+int MUndoPropertyCommand::id() const
+{
+	return Id;
+}
+
+bool MUndoPropertyCommand::mergeWith(const QUndoCommand * other)
+{
+	// совпадения id недостаточно: его может случайно использовать и другая команда
+	auto command = dynamic_cast<const MUndoPropertyCommand *>(other);
+	if (!command)
+		return false;
+	if (command->m_target != m_target || command->m_objectId != m_objectId || command->m_propertyId != m_propertyId)
+		return false;
+
+	// старое значение остаётся своим, разность пересчитывается относительно нового
+	const QVariant old = oldValue();
+	m_newValue = command->m_newValue;
+	setOldValue(old);
+	return true;
+}
+
+qint64 MUndoPropertyCommand::byteSize() const
+{
+	return sizeof(MUndoPropertyCommand) + payloadSize(m_newValue)
+		+ (m_oldIsDelta ? m_oldMiddle.size() : payloadSize(m_oldValue));
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <QUndoCommand>
+#include <QVariant>
+
+#include "MovaviWidgetLib.h"
+#include "MUndoStack.h"
+
+/// @class MUndoPropertyTarget
+/// @brief Объект, применяющий значения свойств при undo / redo MUndoPropertyCommand
+class MOVAVIWIDGET_API MUndoPropertyTarget
+{
+public:
+	virtual ~MUndoPropertyTarget() {}
+
+	/// @brief Устанавливает свойство @a propertyId объекта @a objectId в @a value
+	virtual void setUndoProperty(quint64 objectId, int propertyId, const QVariant & value) = 0;
+};
+
+/**
+ * @class MUndoPropertyCommand
+ * @brief Команда "свойство propertyId объекта objectId изменилось с old на new"
+ *
+ * Заменяет рукописные команды для изменения одного свойства. Хранит только идентификаторы и значения,
+ * значения применяет MUndoPropertyTarget, который должен жить дольше истории.
+ * Подряд идущие изменения того же свойства сливаются в одну команду (см. MUndoStack::mergeInterval()).
+ * Для больших QByteArray и QImage новое значение хранится целиком, а старое - разностью с ним
+ * (общие начало и конец не хранятся), поэтому локальная правка большого значения почти не занимает памяти.
+ * Как и остальные команды MUndoStack, при push() команда не выполняется: значение уже установлено вызывающим.
+ */
+class MOVAVIWIDGET_API MUndoPropertyCommand : public QUndoCommand, public MUndoSizedCommand
+{
+public:
+	enum { Id = 0x4d505243 };
+
+	MUndoPropertyCommand(MUndoPropertyTarget * target, quint64 objectId, int propertyId,
+		const QVariant & oldValue, const QVariant & newValue, QUndoCommand * parent = nullptr);
+
+	quint64 objectId() const { return m_objectId; }
+	int propertyId() const   { return m_propertyId; }
+
+	QVariant oldValue() const;
+	QVariant newValue() const { return m_newValue; }
+
+	void undo() override;
+	void redo() override;
+
+	int id() const override;
+	bool mergeWith(const QUndoCommand * other) override;
+
+	qint64 byteSize() const override;
+
+private:
+	void setOldValue(const QVariant & oldValue);
+
+private:
+	MUndoPropertyTarget * m_target;
+	quint64  m_objectId;
+	int      m_propertyId;
+	QVariant m_newValue;
+
+	/// Старое значение целиком либо, если m_oldIsDelta, байты m_newValue в [m_deltaPrefix, size - m_deltaSuffix),
+	/// заменённые на m_oldMiddle
+	QVariant   m_oldValue;
+	QByteArray m_oldMiddle;
+	int        m_deltaPrefix = 0;
+	int        m_deltaSuffix = 0;
+	bool       m_oldIsDelta = false;
+};
@@ -1,39 +1,424 @@
 #include "MUndoStack.h"
 
 #include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <typeinfo>
 
-#include <QUndoCommand>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
 
-class MUndoStack::TransactionCommand : public QUndoCommand
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtEndian>
+
+namespace {
+
+const size_t ARENA_FIRST_BLOCK_SIZE = 16 * 1024;
+const size_t ARENA_MAX_BLOCK_SIZE   = 1024 * 1024;
+
+/// Журнал: заголовок JOURNAL_MAGIC, затем записи [quint32 размер данных + 1][quint8 вид][данные]
+const char JOURNAL_MAGIC[]        = "MUNDOJ01";
+const int  JOURNAL_HEADER_SIZE    = 8;
+const int  RECORD_HEADER_SIZE     = 5;
+const int  JOURNAL_STREAM_VERSION = QDataStream::Qt_5_6;
+
+const char TRANSACTION_TYPE_NAME[] = "MUndoStack.Transaction";
+
+enum JournalRecord : quint8
+{
+	PushRecord = 1,  ///< данные - команда
+	MergedPushRecord,///< данные - команда, слитая с предыдущей через mergeWith()
+	UndoRecord,
+	RedoRecord,
+	ClearRecord,
+	SnapshotRecord,  ///< данные - команда, выгруженная из памяти; при воспроизведении пропускается
+	OpaqueRecord     ///< несериализуемая команда, воспроизведение дальше невозможно
+};
+
+QHash<QByteArray, MUndoStack::CommandFactory> & commandFactories()
+{
+	static QHash<QByteArray, MUndoStack::CommandFactory> factories;
+	return factories;
+}
+
+/// Корзина k гистограммы: время в [2^(k-1), 2^k) мкс, корзина 0 - меньше микросекунды
+const int HISTOGRAM_BUCKETS = 24;
+
+/// Инструментация стека, который сейчас выполняет undo / redo в этом потоке; нужна командам транзакций,
+/// не знающим о своём стеке
+thread_local MUndoStackInstrumentation * activeInstrumentation = nullptr;
+
+} // namespace
+
+/// Статистика выполнения команд, собирается только при включённой инструментации
+class MUndoStackInstrumentation
 {
-	QStack<QUndoCommand *> commands;
+	struct OperationStats
+	{
+		quint64 count   = 0;
+		qint64  totalNs = 0;
+		qint64  maxNs   = 0;
+		QVector<quint64> histogram = QVector<quint64>(HISTOGRAM_BUCKETS, 0);
+	};
+
+	struct TypeStats
+	{
+		OperationStats undo;
+		OperationStats redo;
+		qint64  totalBytes = 0;
+		qint64  maxBytes   = 0;
+		qint64  slowestNs  = -1;
+		bool    slowestUndo = false;
+		QString slowestText;
+	};
+
+	QHash<QByteArray, TypeStats> stats;
 
 public:
-	TransactionCommand() { }
+	void run(QUndoCommand * command, bool undo)
+	{
+		MUndoStackInstrumentation * previous = activeInstrumentation;
+		activeInstrumentation = this;
+
+		QElapsedTimer timer;
+		timer.start();
+		if (undo)
+			command->undo();
+		else
+			command->redo();
+		const qint64 elapsed = timer.nsecsElapsed();
+
+		activeInstrumentation = previous;
+		record(command, undo, elapsed);
+	}
+
+	void reset()
+	{
+		stats.clear();
+	}
+
+	QByteArray report() const
+	{
+		QJsonArray types;
+		for (auto it = stats.constBegin(); it != stats.constEnd(); ++it)
+		{
+			const TypeStats & type = it.value();
+			const quint64 calls = type.undo.count + type.redo.count;
+
+			QJsonObject bytes;
+			bytes.insert(QStringLiteral("max"), double(type.maxBytes));
+			bytes.insert(QStringLiteral("average"), calls ? double(type.totalBytes) / calls : 0.0);
+
+			QJsonObject slowest;
+			slowest.insert(QStringLiteral("operation"), type.slowestUndo ? QStringLiteral("undo") : QStringLiteral("redo"));
+			slowest.insert(QStringLiteral("text"), type.slowestText);
+			slowest.insert(QStringLiteral("us"), type.slowestNs / 1000.0);
+
+			QJsonObject object;
+			object.insert(QStringLiteral("type"), QString::fromLatin1(it.key()));
+			object.insert(QStringLiteral("undo"), toJson(type.undo));
+			object.insert(QStringLiteral("redo"), toJson(type.redo));
+			object.insert(QStringLiteral("bytes"), bytes);
+			object.insert(QStringLiteral("slowest"), slowest);
+			types.append(object);
+		}
+
+		QJsonObject root;
+		root.insert(QStringLiteral("histogramBuckets"), QStringLiteral("bucket 0: < 1 us, bucket k: [2^(k-1), 2^k) us"));
+		root.insert(QStringLiteral("types"), types);
+		return QJsonDocument(root).toJson(QJsonDocument::Indented);
+	}
+
+private:
+	void record(const QUndoCommand * command, bool undo, qint64 elapsedNs)
+	{
+		TypeStats & type = stats[MUndoStack::commandTypeName(command)];
+		OperationStats & operation = undo ? type.undo : type.redo;
+
+		++operation.count;
+		operation.totalNs += elapsedNs;
+		operation.maxNs = qMax(operation.maxNs, elapsedNs);
+
+		int bucket = 0;
+		for (qint64 us = elapsedNs / 1000; us > 0 && bucket < HISTOGRAM_BUCKETS - 1; us >>= 1)
+			++bucket;
+		++operation.histogram[bucket];
+
+		const qint64 bytes = MUndoStack::commandSize(command);
+		type.totalBytes += bytes;
+		type.maxBytes = qMax(type.maxBytes, bytes);
+
+		if (elapsedNs > type.slowestNs)
+		{
+			type.slowestNs   = elapsedNs;
+			type.slowestUndo = undo;
+			type.slowestText = command->text();
+		}
+	}
+
+	static QJsonObject toJson(const OperationStats & operation)
+	{
+		QJsonArray histogram;
+		for (quint64 value : operation.histogram)
+			histogram.append(double(value));
+
+		QJsonObject object;
+		object.insert(QStringLiteral("count"), double(operation.count));
+		object.insert(QStringLiteral("totalUs"), operation.totalNs / 1000.0);
+		object.insert(QStringLiteral("maxUs"), operation.maxNs / 1000.0);
+		object.insert(QStringLiteral("histogram"), histogram);
+		return object;
+	}
+};
+
+namespace {
+
+/// undo() / redo() команды внутри транзакции: замеряется, только если стек выполняет транзакцию с инструментацией
+inline void runCommand(QUndoCommand * command, bool undo)
+{
+	if (Q_UNLIKELY(activeInstrumentation))
+		activeInstrumentation->run(command, undo);
+	else if (undo)
+		command->undo();
+	else
+		command->redo();
+}
+
+} // namespace
+
+/// Арена команд одной транзакции: память выделяется подряд из растущих блоков и освобождается только целиком.
+/// Деструкторы размещённых в ней команд вызывает владелец (см. MUndoStack::destroyCommand).
+class MUndoStack::Arena
+{
+	struct Block
+	{
+		char * data;
+		size_t size;
+	};
+
+	QVector<Block> blocks;
+	size_t used = 0;
+	size_t nextBlockSize = ARENA_FIRST_BLOCK_SIZE;
+
+public:
+	Arena() { }
+	~Arena()
+	{
+		for (const auto & block : blocks)
+			::operator delete(block.data);
+	}
+
+	Arena(const Arena &) = delete;
+	Arena & operator=(const Arena &) = delete;
+
+	void * allocate(size_t size, size_t align)
+	{
+		if (align > alignof(std::max_align_t))
+			return nullptr;
+
+		if (!blocks.isEmpty())
+		{
+			const Block & block = blocks.last();
+			const size_t offset = (used + align - 1) & ~(align - 1);
+			if (offset + size <= block.size)
+			{
+				used = offset + size;
+				return block.data + offset;
+			}
+		}
+
+		// начало блока от ::operator new выровнено на max_align_t
+		const size_t blockSize = qMax(size, nextBlockSize);
+		nextBlockSize = qMin(nextBlockSize * 2, ARENA_MAX_BLOCK_SIZE);
+		blocks.append(Block { static_cast<char *>(::operator new(blockSize)), blockSize });
+		used = size;
+		return blocks.last().data;
+	}
+
+	bool owns(const void * pointer) const
+	{
+		auto address = static_cast<const char *>(pointer);
+		for (const auto & block : blocks)
+			if (address >= block.data && address < block.data + block.size)
+				return true;
+		return false;
+	}
+};
+
+class MUndoStack::TransactionCommand : public QUndoCommand, public MUndoSizedCommand
+{
+	QVector<QUndoCommand *> commands;
+	Arena * arena;
+
+public:
+	TransactionCommand(QVector<QUndoCommand *> commands, Arena * arena)
+		: commands(std::move(commands))
+		, arena(arena)
+	{ }
 	~TransactionCommand()
 	{
 		for (auto command : commands)
-			delete command;
+			MUndoStack::destroyCommand(command, arena);
 		commands.clear();
+		delete arena;
 	}
 
 	void undo() override
 	{
 		for (int i = commands.size() - 1; i >= 0; --i)
-			commands[i]->undo();
+			runCommand(commands[i], true);
 	}
 	void redo() override
 	{
 		for (int i = 0; i < commands.size(); ++i)
-			commands[i]->redo();
+			runCommand(commands[i], false);
 	}
-	void push(QUndoCommand * cmd)
+	qint64 byteSize() const override
 	{
-		commands.push(cmd);
+		qint64 size = sizeof(TransactionCommand) + commands.capacity() * sizeof(QUndoCommand *);
+		for (auto command : commands)
+			size += MUndoStack::commandSize(command);
+		return size;
 	}
-	bool isEmpty()
+	const QVector<QUndoCommand *> & children() const
 	{
-		return commands.isEmpty();
+		return commands;
+	}
+};
+
+/// Файл журнала: запись идёт обычной дозаписью, чтение выгруженных команд - через отображение файла в память
+class MUndoStack::Journal
+{
+public:
+	QFile file;
+	int   window;
+	bool  replaying = false;
+
+	Journal(const QString & path, int window)
+		: file(path)
+		, window(window)
+	{ }
+	~Journal()
+	{
+		unmap();
+	}
+
+	bool hasValidHeader()
+	{
+		return file.size() >= JOURNAL_HEADER_SIZE && file.peek(JOURNAL_HEADER_SIZE) == QByteArray(JOURNAL_MAGIC, JOURNAL_HEADER_SIZE);
+	}
+
+	bool reset()
+	{
+		unmap();
+		return file.resize(0) && file.write(JOURNAL_MAGIC, JOURNAL_HEADER_SIZE) == JOURNAL_HEADER_SIZE && file.flush();
+	}
+
+	/// Дописывает запись; возвращает смещение её данных в файле или -1
+	qint64 append(JournalRecord kind, const QByteArray & data = QByteArray())
+	{
+		const qint64 position = file.size();
+		char header[RECORD_HEADER_SIZE];
+		qToBigEndian<quint32>(quint32(data.size() + 1), reinterpret_cast<uchar *>(header));
+		header[4] = char(kind);
+
+		if (!file.seek(position)
+			|| file.write(header, RECORD_HEADER_SIZE) != RECORD_HEADER_SIZE
+			|| file.write(data) != data.size()
+			|| !file.flush())
+			return -1;
+		return position + RECORD_HEADER_SIZE;
+	}
+
+	/// Данные записи по смещению из append(), без копирования; действительны до следующего map()
+	QByteArray data(qint64 offset)
+	{
+		// файл растёт, поэтому записи, сделанные после последнего отображения, требуют повторного map()
+		auto mappedUpTo = [this](qint64 end) { return mapped && end <= mapSize; };
+		if (offset < RECORD_HEADER_SIZE || (!mappedUpTo(offset) && (!map() || !mappedUpTo(offset))))
+			return QByteArray();
+
+		const quint32 length = qFromBigEndian<quint32>(mapped + offset - RECORD_HEADER_SIZE);
+		if (length == 0 || (!mappedUpTo(offset + length - 1) && (!map() || !mappedUpTo(offset + length - 1))))
+			return QByteArray();
+		return QByteArray::fromRawData(reinterpret_cast<const char *>(mapped + offset), int(length - 1));
+	}
+
+	bool map()
+	{
+		unmap();
+		mapSize = file.size();
+		mapped  = file.map(0, mapSize);
+		if (!mapped)
+			mapSize = 0;
+		return mapped != nullptr;
+	}
+
+	void unmap()
+	{
+		if (mapped)
+			file.unmap(mapped);
+		mapped  = nullptr;
+		mapSize = 0;
+	}
+
+	uchar * mapped  = nullptr;
+	qint64  mapSize = 0;
+};
+
+/// Заместитель выгруженной в журнал команды: хранит только смещение записи и текст для истории
+class MUndoStack::OffloadedCommand : public QUndoCommand, public MUndoSizedCommand
+{
+public:
+	OffloadedCommand(qint64 offset, const QString & text)
+		: QUndoCommand(text)
+		, offset(offset)
+	{ }
+
+	void undo() override { assert(!"offloaded command must be materialized before undo"); }
+	void redo() override { assert(!"offloaded command must be materialized before redo"); }
+
+	qint64 byteSize() const override
+	{
+		return sizeof(OffloadedCommand) + text().size() * sizeof(QChar);
+	}
+
+	const qint64 offset;
+};
+
+/// Откладывает сигналы об изменении индекса и доступности undo / redo до конца внешней операции
+class MUndoStack::NotificationBatch
+{
+	MUndoStack * stack;
+
+public:
+	explicit NotificationBatch(MUndoStack * stack)
+		: stack(stack)
+	{
+		if (stack->m_notificationDepth++ == 0)
+			stack->m_notificationState = stack->notificationState();
+	}
+	~NotificationBatch()
+	{
+		if (--stack->m_notificationDepth != 0)
+			return;
+
+		const NotificationState before = stack->m_notificationState;
+		const NotificationState after  = stack->notificationState();
+		if (before.index != after.index)
+			emit stack->indexChanged(after.index);
+		if (before.canUndo != after.canUndo)
+			emit stack->canUndoChanged(after.canUndo);
+		if (before.canRedo != after.canRedo)
+			emit stack->canRedoChanged(after.canRedo);
+		if (before.clean != after.clean)
+			emit stack->cleanChanged(after.clean);
 	}
 };
 
@@ -44,45 +429,225 @@ MUndoStack::MUndoStack(QObject *parent)
 
 MUndoStack::~MUndoStack()
 {
-	clear();
+	while (!m_transactions.isEmpty())
+	{
+		const Frame frame = m_transactions.pop();
+		deleteCommands(m_undoCommands, frame.undoStart, m_undoCommands.size(), frame.arena);
+		deleteCommands(m_redoCommands, frame.redoStart, m_redoCommands.size(), frame.arena);
+		delete frame.arena;
+	}
+	deleteCommands(m_undoCommands, 0, m_undoCommands.size());
+	deleteCommands(m_redoCommands, 0, m_redoCommands.size());
 }
 
 void MUndoStack::undo()
 {
-	if (!canUndo())
-		return;
-
-	auto stack = currentStack();
-	stack->undoImpl();
+	NotificationBatch batch(this);
+	undoStep();
 }
 
 void MUndoStack::redo()
 {
-	if (!canRedo())
+	NotificationBatch batch(this);
+	redoStep();
+}
+
+void MUndoStack::setIndex(int index)
+{
+	const int current = count();
+	const int target  = qBound(0, index, current + m_redoCommands.size() - redoStart());
+	if (target == current)
 		return;
 
-	auto stack = currentStack();
-	stack->redoImpl();
+	NotificationBatch batch(this);
+	const bool jump = qAbs(target - current) > 1;
+	if (jump)
+		emit indexJumpStarted(current, target);
+
+	while (count() > target && undoStep()) { }
+	while (count() < target && redoStep()) { }
+
+	if (jump)
+		emit indexJumpFinished();
+}
+
+int MUndoStack::index() const
+{
+	return count();
+}
+
+int MUndoStack::cleanIndex() const
+{
+	return m_cleanIndex;
+}
+
+bool MUndoStack::isClean() const
+{
+	return m_transactions.isEmpty() && rootIndex() == m_cleanIndex;
+}
+
+void MUndoStack::setClean()
+{
+	assert(m_transactions.isEmpty());
+	NotificationBatch batch(this);
+	m_cleanIndex = rootIndex();
 }
 
 bool MUndoStack::canUndo() const
 {
-	return currentStack()->canUndoImpl();
+	return m_undoCommands.size() > undoStart();
 }
 
 bool MUndoStack::canRedo() const
 {
-	return currentStack()->canRedoImpl();
+	return m_redoCommands.size() > redoStart();
 }
 
 void MUndoStack::push(QUndoCommand * command)
 {
-	currentStack()->pushImpl(command);
+	NotificationBatch batch(this);
+	pushImpl(command);
+}
+
+int MUndoStack::undoLimit() const
+{
+	return m_undoLimit;
+}
+
+void MUndoStack::setUndoLimit(int limit)
+{
+	assert(limit >= 0);
+	NotificationBatch batch(this);
+	m_undoLimit = qMax(0, limit);
+	applyLimits();
+}
+
+qint64 MUndoStack::memoryLimit() const
+{
+	return m_memoryLimit;
+}
+
+void MUndoStack::setMemoryLimit(qint64 bytes)
+{
+	assert(bytes >= 0);
+	NotificationBatch batch(this);
+	m_memoryLimit = qMax<qint64>(0, bytes);
+	applyLimits();
+}
+
+qint64 MUndoStack::historyMemory() const
+{
+	return m_historyMemory;
+}
+
+int MUndoStack::mergeInterval() const
+{
+	return m_mergeInterval;
+}
+
+void MUndoStack::setMergeInterval(int msecs)
+{
+	assert(msecs >= 0);
+	m_mergeInterval = qMax(0, msecs);
+}
+
+qint64 MUndoStack::commandSize(const QUndoCommand * command)
+{
+	auto sized = dynamic_cast<const MUndoSizedCommand *>(command);
+	qint64 size = sized ? sized->byteSize() : qint64(sizeof(QUndoCommand));
+	for (int i = 0; i < command->childCount(); ++i)
+		size += commandSize(command->child(i));
+	return size;
+}
+
+void MUndoStack::registerCommandType(const QByteArray & typeName, CommandFactory factory)
+{
+	assert(typeName != TRANSACTION_TYPE_NAME);
+	commandFactories().insert(typeName, std::move(factory));
+}
+
+bool MUndoStack::openJournal(const QString & path, int memoryWindow, bool replay)
+{
+	NotificationBatch batch(this);
+	closeJournal();
+
+	QScopedPointer<Journal> journal(new Journal(path, qMax(1, memoryWindow)));
+	if (!journal->file.open(QIODevice::ReadWrite))
+		return false;
+
+	bool complete = true;
+	if (replay && journal->hasValidHeader())
+	{
+		clear();
+		m_journal.reset(journal.take());
+		m_journal->replaying = true;
+		complete = replayJournal();
+		m_journal->replaying = false;
+	}
+	else
+	{
+		if (!journal->reset())
+			return false;
+		m_journal.reset(journal.take());
+	}
+
+	m_offloaded = 0;
+	applyLimits();
+	return complete;
+}
+
+void MUndoStack::closeJournal()
+{
+	if (!m_journal)
+		return;
+
+	NotificationBatch batch(this);
+	for (int i = qMin(m_offloaded, m_undoCommands.size()) - 1; i >= 0; --i)
+		if (!materialize(i))
+			break;
+
+	m_journal.reset();
+	m_journalOffsets.clear();
+	m_offloaded = 0;
+}
+
+bool MUndoStack::isJournalOpen() const
+{
+	return !m_journal.isNull();
+}
+
+int MUndoStack::journalWindow() const
+{
+	return m_journal ? m_journal->window : 0;
+}
+
+bool MUndoStack::isInstrumentationEnabled() const
+{
+	return !m_instrumentation.isNull();
+}
+
+void MUndoStack::setInstrumentationEnabled(bool enabled)
+{
+	if (enabled == isInstrumentationEnabled())
+		return;
+	m_instrumentation.reset(enabled ? new MUndoStackInstrumentation : nullptr);
+}
+
+void MUndoStack::resetInstrumentation()
+{
+	if (m_instrumentation)
+		m_instrumentation->reset();
+}
+
+QByteArray MUndoStack::instrumentationReport() const
+{
+	return m_instrumentation ? m_instrumentation->report() : QByteArray("{}");
 }
 
 void MUndoStack::startTransaction()
 {
-	m_transactions.push(new MUndoStack(this));
+	NotificationBatch batch(this);
+	m_transactions.push(Frame { m_undoCommands.size(), m_redoCommands.size(), nullptr });
 }
 
 void MUndoStack::commitTransaction()
@@ -92,17 +657,31 @@ void MUndoStack::commitTransaction()
 	if (!transactionAvailable)
 		return;
 
-	auto transaction = m_transactions.pop();
-	auto command     = new TransactionCommand;
+	NotificationBatch batch(this);
+
+	// redo-команды транзакции после её закрытия недоступны
+	addHistoryMemory(-deleteCommands(m_redoCommands, redoStart(), m_redoCommands.size(), currentArena()));
+
+	const Frame frame = m_transactions.pop();
+	const int   start = frame.undoStart;
+	if (start == m_undoCommands.size())
+	{
+		delete frame.arena;
+		return;
+	}
+
+	qint64 movedSize = 0;
+	for (int i = start; i < m_undoCommands.size(); ++i)
+		movedSize += commandSize(m_undoCommands[i]);
 
-	for (int i = 0; i < transaction->count(); ++i)
-		command->push(transaction->command(i));
+	auto command = new TransactionCommand(m_undoCommands.mid(start), frame.arena);
+	m_undoCommands.resize(start);
+	m_historyMemory -= movedSize; // pushImpl() учтёт команды заново в составе транзакции
 
-	if (!command->isEmpty()) push(command);
-	else                     delete command;
+	m_lastPush.invalidate();
+	push(command);
 
-	transaction->clearNoDelete();
-	delete transaction;
+	applyLimits(); // транзакция закрыта, её команды теперь можно вытеснять
 }
 
 void MUndoStack::rollbackTransaction()
@@ -112,21 +691,44 @@ void MUndoStack::rollbackTransaction()
 	if (!transactionAvailable)
 		return;
 
-	auto transaction = m_transactions.pop();
-	while(transaction->canUndo())
-		transaction->undo();
-	delete transaction;
+	NotificationBatch batch(this);
+	const Frame frame = m_transactions.pop();
+	for (int i = m_undoCommands.size() - 1; i >= frame.undoStart; --i)
+		execute(m_undoCommands[i], true);
+
+	qint64 removed = deleteCommands(m_undoCommands, frame.undoStart, m_undoCommands.size(), frame.arena);
+	removed += deleteCommands(m_redoCommands, frame.redoStart, m_redoCommands.size(), frame.arena);
+	delete frame.arena;
+	m_lastPush.invalidate();
+	addHistoryMemory(-removed);
 }
 
 void MUndoStack::clear()
 {
-	removeUndoCommands();
-	removeRedoCommands();
+	NotificationBatch batch(this);
+	// очищается только история самого стека, открытые транзакции сохраняются
+	const int undoEnd = m_transactions.isEmpty() ? m_undoCommands.size() : m_transactions.first().undoStart;
+	const int redoEnd = m_transactions.isEmpty() ? m_redoCommands.size() : m_transactions.first().redoStart;
+
+	if (journalWritable())
+		m_journal->append(ClearRecord);
+
+	qint64 removed = deleteCommands(m_undoCommands, 0, undoEnd);
+	removed += deleteCommands(m_redoCommands, 0, redoEnd);
+	for (auto & frame : m_transactions)
+	{
+		frame.undoStart -= undoEnd;
+		frame.redoStart -= redoEnd;
+	}
+	m_offloaded = 0;
+	m_cleanIndex = 0;
+	m_lastPush.invalidate();
+	addHistoryMemory(-removed);
 }
 
 int MUndoStack::count() const
 {
-	return m_undoCommands.size();
+	return m_undoCommands.size() - undoStart();
 }
 
 QUndoCommand * MUndoStack::command(int index)
@@ -136,73 +738,506 @@ QUndoCommand * MUndoStack::command(int index)
 	if (!indexValid)
 		return nullptr;
 
-	return m_undoCommands[index];
+	return materialize(undoStart() + index);
 }
 
 void MUndoStack::clearNoDelete()
 {
+	// команды в аренах не могут пережить свои арены
+	for (const auto & frame : m_transactions)
+	{
+		if (!frame.arena)
+			continue;
+		for (int i = frame.undoStart; i < m_undoCommands.size(); ++i)
+			if (frame.arena->owns(m_undoCommands[i]))
+				destroyCommand(m_undoCommands[i], frame.arena);
+		for (int i = frame.redoStart; i < m_redoCommands.size(); ++i)
+			if (frame.arena->owns(m_redoCommands[i]))
+				destroyCommand(m_redoCommands[i], frame.arena);
+		delete frame.arena;
+	}
+
+	// заместители выгруженных команд принадлежат стеку
+	for (int i = 0; i < qMin(m_offloaded, m_undoCommands.size()); ++i)
+		if (auto stub = dynamic_cast<OffloadedCommand *>(m_undoCommands[i]))
+			delete stub;
+	m_journalOffsets.clear();
+	m_offloaded = 0;
+
 	m_undoCommands.clear();
 	m_redoCommands.clear();
+	m_transactions.clear();
+	addHistoryMemory(-m_historyMemory);
 }
 
-void MUndoStack::removeUndoCommands()
+MUndoStack::NotificationState MUndoStack::notificationState() const
 {
-	while(!m_undoCommands.isEmpty())
-		delete m_undoCommands.pop();
+	return NotificationState { index(), canUndo(), canRedo(), isClean() };
 }
 
-void MUndoStack::removeRedoCommands()
+int MUndoStack::undoStart() const
 {
-	while (!m_redoCommands.isEmpty())
-		delete m_redoCommands.pop();
+	return m_transactions.isEmpty() ? 0 : m_transactions.top().undoStart;
 }
 
-const MUndoStack * MUndoStack::currentStack() const
+int MUndoStack::redoStart() const
 {
-	return !m_transactions.isEmpty()
-		? m_transactions.top()
-		: this;
+	return m_transactions.isEmpty() ? 0 : m_transactions.top().redoStart;
 }
 
-MUndoStack * MUndoStack::currentStack()
+int MUndoStack::rootIndex() const
 {
-	return !m_transactions.isEmpty()
-		? m_transactions.top()
-		: this;
+	return m_transactions.isEmpty() ? m_undoCommands.size() : m_transactions.first().undoStart;
 }
 
-void MUndoStack::undoImpl()
+MUndoStack::Arena * MUndoStack::currentArena() const
 {
-	if (m_undoCommands.isEmpty())
-		return;
+	return m_transactions.isEmpty() ? nullptr : m_transactions.top().arena;
+}
 
-	auto command = m_undoCommands.pop();
-	m_redoCommands.push(command);
-	command->undo();
+void * MUndoStack::allocate(size_t size, size_t align)
+{
+	if (m_transactions.isEmpty())
+		return nullptr;
+
+	Frame & frame = m_transactions.top();
+	if (!frame.arena)
+		frame.arena = new Arena;
+	return frame.arena->allocate(size, align);
 }
 
-void MUndoStack::redoImpl()
+void MUndoStack::destroyCommand(QUndoCommand * command, const Arena * arena)
 {
-	if (m_redoCommands.isEmpty())
-		return;
+	if (arena && arena->owns(command))
+		command->~QUndoCommand(); // память освободится вместе с ареной
+	else
+		delete command;
+}
+
+qint64 MUndoStack::deleteCommands(QVector<QUndoCommand *> & commands, int from, int to, const Arena * arena)
+{
+	qint64 removed = 0;
+	for (int i = from; i < to; ++i)
+	{
+		removed += commandSize(commands[i]);
+		if (!m_journalOffsets.isEmpty())
+			m_journalOffsets.remove(commands[i]);
+		destroyCommand(commands[i], arena);
+	}
+	commands.remove(from, to - from);
+	return removed;
+}
 
-	auto command = m_redoCommands.pop();
-	m_undoCommands.push(command);
-	command->redo();
+void MUndoStack::removeRedoCommands()
+{
+	addHistoryMemory(-deleteCommands(m_redoCommands, redoStart(), m_redoCommands.size(), currentArena()));
 }
 
-bool MUndoStack::canUndoImpl() const
+void MUndoStack::addHistoryMemory(qint64 delta)
 {
-	return !m_undoCommands.isEmpty();
+	if (delta == 0)
+		return;
+	m_historyMemory += delta;
+	emit historyMemoryChanged(m_historyMemory);
 }
 
-bool MUndoStack::canRedoImpl() const
+void MUndoStack::applyLimits()
 {
-	return !m_redoCommands.isEmpty();
+	if (!m_transactions.isEmpty())
+		return;
+
+	offloadToJournal(); // выгруженные команды занимают мало памяти, и вытеснять по памяти приходится реже
+
+	// вытесняются только самые старые undo-команды; последнюю оставляем, даже если она одна превышает лимит памяти
+	int evicted = 0;
+	qint64 removed = 0;
+	while (evicted < m_undoCommands.size())
+	{
+		const int remaining = m_undoCommands.size() - evicted;
+		const bool overCount  = m_undoLimit > 0 && remaining > m_undoLimit;
+		const bool overMemory = m_memoryLimit > 0 && remaining > 1 && m_historyMemory - removed > m_memoryLimit;
+		if (!overCount && !overMemory)
+			break;
+
+		removed += commandSize(m_undoCommands[evicted]);
+		++evicted;
+	}
+	if (evicted == 0)
+		return;
+
+	deleteCommands(m_undoCommands, 0, evicted);
+	m_offloaded = qMax(0, m_offloaded - evicted);
+	m_cleanIndex = m_cleanIndex >= evicted ? m_cleanIndex - evicted : -1;
+	addHistoryMemory(-removed);
 }
 
 void MUndoStack::pushImpl(QUndoCommand * command)
 {
-	m_undoCommands.push(command);
 	removeRedoCommands();
+	if (m_transactions.isEmpty() && m_cleanIndex > m_undoCommands.size())
+		m_cleanIndex = -1; // сохранённое состояние было среди удалённых redo-команд
+
+	// команду записываем до слияния: после него она уже уничтожена
+	const bool journaled = journalWritable() && m_transactions.isEmpty();
+	QByteArray record;
+	bool serialized = false;
+	if (journaled)
+	{
+		QDataStream stream(&record, QIODevice::WriteOnly);
+		stream.setVersion(JOURNAL_STREAM_VERSION);
+		serialized = writeCommand(stream, command);
+	}
+
+	if (tryMerge(command))
+	{
+		destroyCommand(command, currentArena());
+		if (journaled)
+		{
+			m_journalOffsets.remove(m_undoCommands.last()); // запись в журнале больше не соответствует команде
+			m_journal->append(serialized ? MergedPushRecord : OpaqueRecord, record);
+		}
+	}
+	else
+	{
+		m_undoCommands.append(command);
+		addHistoryMemory(commandSize(command));
+		if (journaled)
+		{
+			const qint64 offset = m_journal->append(serialized ? PushRecord : OpaqueRecord, record);
+			if (serialized && offset >= 0)
+				m_journalOffsets.insert(command, offset);
+		}
+	}
+	m_lastPush.start();
+	applyLimits();
+}
+
+bool MUndoStack::tryMerge(QUndoCommand * command)
+{
+	if (!canUndo() || command->id() == -1)
+		return false;
+
+	// слияние изменило бы сохранённое состояние
+	if (m_transactions.isEmpty() && m_undoCommands.size() == m_cleanIndex)
+		return false;
+
+	auto top = materialize(m_undoCommands.size() - 1);
+	if (!top)
+		return false;
+	if (top->id() != command->id())
+		return false;
+
+	if (m_mergeInterval > 0 && (!m_lastPush.isValid() || m_lastPush.elapsed() > m_mergeInterval))
+		return false;
+
+	const qint64 sizeBefore = commandSize(top);
+	if (!top->mergeWith(command))
+		return false;
+
+	addHistoryMemory(commandSize(top) - sizeBefore);
+	return true;
+}
+
+bool MUndoStack::undoStep()
+{
+	if (!canUndo())
+		return false;
+
+	if (m_journal && m_transactions.isEmpty())
+	{
+		if (!materialize(m_undoCommands.size() - 1))
+			return false;
+		if (journalWritable())
+			m_journal->append(UndoRecord);
+	}
+
+	auto command = m_undoCommands.takeLast();
+	m_offloaded = qMin(m_offloaded, m_undoCommands.size());
+	m_redoCommands.append(command);
+	m_lastPush.invalidate();
+	execute(command, true);
+	return true;
+}
+
+bool MUndoStack::redoStep()
+{
+	if (!canRedo())
+		return false;
+
+	if (journalWritable() && m_transactions.isEmpty())
+		m_journal->append(RedoRecord);
+
+	auto command = m_redoCommands.takeLast();
+	m_undoCommands.append(command);
+	m_lastPush.invalidate();
+	execute(command, false);
+	return true;
+}
+
+void MUndoStack::execute(QUndoCommand * command, bool undo)
+{
+	if (Q_UNLIKELY(m_instrumentation))
+		m_instrumentation->run(command, undo);
+	else if (undo)
+		command->undo();
+	else
+		command->redo();
+}
+
+QByteArray MUndoStack::commandTypeName(const QUndoCommand * command)
+{
+	if (dynamic_cast<const TransactionCommand *>(command))
+		return TRANSACTION_TYPE_NAME;
+	if (auto serializable = dynamic_cast<const MUndoSerializableCommand *>(command))
+		return serializable->typeName();
+	const char * name = typeid(*command).name();
+#ifdef __GNUG__
+	// GCC и Clang возвращают декорированные имена, в отчёте они были бы нечитаемы
+	int status = 0;
+	char * demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+	if (status == 0 && demangled)
+	{
+		const QByteArray result(demangled);
+		std::free(demangled);
+		return result;
+	}
+#endif
+	return name;
+}
+
+bool MUndoStack::journalWritable() const
+{
+	return m_journal && !m_journal->replaying;
+}
+
+void MUndoStack::offloadToJournal()
+{
+	if (!journalWritable() || !m_transactions.isEmpty())
+		return;
+
+	qint64 delta = 0;
+	for (const int end = m_undoCommands.size() - m_journal->window; m_offloaded < end; ++m_offloaded)
+	{
+		QUndoCommand * command = m_undoCommands[m_offloaded];
+		if (dynamic_cast<OffloadedCommand *>(command))
+			continue;
+
+		qint64 offset = m_journalOffsets.value(command, -1);
+		if (offset < 0)
+		{
+			QByteArray record;
+			QDataStream stream(&record, QIODevice::WriteOnly);
+			stream.setVersion(JOURNAL_STREAM_VERSION);
+			if (!writeCommand(stream, command))
+				continue; // несериализуемые команды остаются в памяти
+			offset = m_journal->append(SnapshotRecord, record);
+			if (offset < 0)
+				continue;
+		}
+
+		auto stub = new OffloadedCommand(offset, command->text());
+		delta += commandSize(stub) - commandSize(command);
+		m_journalOffsets.remove(command);
+		delete command;
+		m_undoCommands[m_offloaded] = stub;
+	}
+	addHistoryMemory(delta);
+}
+
+QUndoCommand * MUndoStack::materialize(int index)
+{
+	QUndoCommand * command = m_undoCommands[index];
+	if (!m_journal)
+		return command;
+
+	auto stub = dynamic_cast<OffloadedCommand *>(command);
+	if (!stub)
+		return command;
+
+	QDataStream stream(m_journal->data(stub->offset));
+	stream.setVersion(JOURNAL_STREAM_VERSION);
+	command = readCommand(stream);
+	if (!command)
+	{
+		// журнал повреждён или тип команды не зарегистрирован: эта и более старая история потеряны
+		addHistoryMemory(-deleteCommands(m_undoCommands, 0, index + 1));
+		// заместители лежат ниже всех открытых транзакций (выгрузка идёт только вне них), их кадры сдвигаются целиком
+		for (auto & frame : m_transactions)
+		{
+			assert(frame.undoStart > index);
+			frame.undoStart -= index + 1;
+		}
+		m_offloaded = qMax(0, m_offloaded - index - 1);
+		m_cleanIndex = m_cleanIndex > index ? m_cleanIndex - index - 1 : -1;
+		return nullptr;
+	}
+
+	addHistoryMemory(commandSize(command) - commandSize(stub));
+	m_journalOffsets.insert(command, stub->offset);
+	// m_offloaded не понижается: ниже него могут оставаться другие заместители, и closeJournal()
+	// с clearNoDelete() должны их найти; восстановленная команда просто остаётся в памяти
+	m_undoCommands[index] = command;
+	delete stub;
+	return command;
+}
+
+bool MUndoStack::replayJournal()
+{
+	Journal & journal = *m_journal;
+	if (!journal.map())
+		return false;
+
+	const qint64 size = journal.mapSize;
+	qint64 position = JOURNAL_HEADER_SIZE;
+	bool complete = true;
+	while (position + RECORD_HEADER_SIZE <= size)
+	{
+		const quint32 length = qFromBigEndian<quint32>(journal.mapped + position);
+		if (length == 0 || position + 4 + length > size)
+			break; // запись, недописанная при сбое
+
+		const JournalRecord kind = JournalRecord(journal.mapped[position + 4]);
+		const qint64 offset = position + RECORD_HEADER_SIZE;
+		QDataStream stream(QByteArray::fromRawData(reinterpret_cast<const char *>(journal.mapped + offset), int(length - 1)));
+		stream.setVersion(JOURNAL_STREAM_VERSION);
+
+		bool applied = true;
+		switch (kind)
+		{
+		case PushRecord:
+		case MergedPushRecord:
+			if (QUndoCommand * command = readCommand(stream))
+			{
+				execute(command, false);
+				removeRedoCommands();
+
+				QUndoCommand * top = canUndo() ? m_undoCommands.last() : nullptr;
+				const qint64 sizeBefore = top ? commandSize(top) : 0;
+				if (kind == MergedPushRecord && top && top->mergeWith(command))
+				{
+					addHistoryMemory(commandSize(top) - sizeBefore);
+					m_journalOffsets.remove(top);
+					delete command;
+				}
+				else
+				{
+					m_undoCommands.append(command);
+					addHistoryMemory(commandSize(command));
+					m_journalOffsets.insert(command, offset);
+				}
+				applyLimits();
+			}
+			else
+			{
+				applied = false;
+			}
+			break;
+		case UndoRecord:
+			applied = canUndo();
+			undo();
+			break;
+		case RedoRecord:
+			applied = canRedo();
+			redo();
+			break;
+		case ClearRecord:
+			clear();
+			break;
+		case SnapshotRecord:
+			break;
+		default:
+			applied = false;
+			break;
+		}
+
+		if (!applied)
+		{
+			complete = false;
+			break;
+		}
+		position += 4 + length;
+	}
+
+	// всё после последней воспроизведённой записи отбрасывается, новые записи пойдут следом за ней
+	journal.unmap();
+	journal.file.resize(position);
+	return complete;
+}
+
+bool MUndoStack::writeCommand(QDataStream & stream, const QUndoCommand * command)
+{
+	QByteArray typeName;
+	QByteArray payload;
+	QDataStream payloadStream(&payload, QIODevice::WriteOnly);
+	payloadStream.setVersion(stream.version());
+
+	if (auto transaction = dynamic_cast<const TransactionCommand *>(command))
+	{
+		typeName = TRANSACTION_TYPE_NAME;
+		payloadStream << quint32(transaction->children().size());
+		for (auto child : transaction->children())
+			if (!writeCommand(payloadStream, child))
+				return false;
+	}
+	else if (auto serializable = dynamic_cast<const MUndoSerializableCommand *>(command))
+	{
+		// serialize() пишет только состояние самой команды, а дочерние QUndoCommand в журнал не попадают:
+		// такую команду нельзя восстановить целиком, поэтому она остаётся в памяти
+		if (command->childCount() > 0)
+			return false;
+		typeName = serializable->typeName();
+		serializable->serialize(payloadStream);
+	}
+	else
+	{
+		return false;
+	}
+
+	stream << typeName << command->text() << payload;
+	return stream.status() == QDataStream::Ok;
+}
+
+QUndoCommand * MUndoStack::readCommand(QDataStream & stream)
+{
+	QByteArray typeName;
+	QString    text;
+	QByteArray payload;
+	stream >> typeName >> text >> payload;
+	if (stream.status() != QDataStream::Ok)
+		return nullptr;
+
+	QDataStream payloadStream(payload);
+	payloadStream.setVersion(stream.version());
+
+	QUndoCommand * command = nullptr;
+	if (typeName == TRANSACTION_TYPE_NAME)
+	{
+		quint32 count = 0;
+		payloadStream >> count;
+
+		QVector<QUndoCommand *> children;
+		for (quint32 i = 0; i < count; ++i)
+		{
+			QUndoCommand * child = readCommand(payloadStream);
+			if (!child)
+			{
+				qDeleteAll(children);
+				return nullptr;
+			}
+			children.append(child);
+		}
+		command = new TransactionCommand(children, nullptr);
+	}
+	else
+	{
+		const CommandFactory factory = commandFactories().value(typeName);
+		if (!factory)
+			return nullptr;
+		command = factory(payloadStream);
+		if (!command)
+			return nullptr;
+	}
+
+	command->setText(text);
+	return command;
 }
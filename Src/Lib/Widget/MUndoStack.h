@@ -1,22 +1,104 @@
 #pragma once
 
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QObject>
+#include <QScopedPointer>
 #include <QStack>
+#include <QUndoCommand>
+#include <QVector>
 
 #include "MovaviWidgetLib.h"
 
-class QUndoCommand;
+class QDataStream;
+class MUndoStackInstrumentation;
+
+/**
+ * @brief Интерфейс для команд, которые умеют оценивать занимаемую ими память.
+ * Наследуется командой вместе с QUndoCommand. Для остальных команд MUndoStack считает
+ * размер равным sizeof(QUndoCommand).
+ */
+class MOVAVIWIDGET_API MUndoSizedCommand
+{
+public:
+	virtual ~MUndoSizedCommand() {}
+
+	/// @brief Примерный объём памяти, занимаемый командой, в байтах (без дочерних команд QUndoCommand)
+	virtual qint64 byteSize() const = 0;
+};
+
+/**
+ * @brief Интерфейс для команд, которые можно записать в журнал MUndoStack.
+ * Наследуется командой вместе с QUndoCommand. Фабрика, восстанавливающая команду по записанным данным,
+ * регистрируется через MUndoStack::registerCommandType() под тем же typeName().
+ * Текст команды (QUndoCommand::text()) сохраняется и восстанавливается самим MUndoStack.
+ */
+class MOVAVIWIDGET_API MUndoSerializableCommand
+{
+public:
+	virtual ~MUndoSerializableCommand() {}
+
+	virtual QByteArray typeName() const = 0;
+	/// @brief Записывает состояние команды, достаточное для её восстановления
+	/// @note Дочерние команды QUndoCommand не записываются, поэтому команды с ними MUndoStack в журнал не выгружает
+	virtual void serialize(QDataStream & stream) const = 0;
+};
 
 /**
  * @brief MUndoStack по поведению подобен QUndoStack.
  * Но предоставляет вложенные транзакции и возможность undo / redo во время транакции
  * Если какого-то функционала QUndoStack не хватает, его можно добавить
+ *
+ * Команды всех уровней хранятся в двух плоских массивах (undo и redo), а открытая транзакция -
+ * это лишь кадр со смещениями начала своего уровня в этих массивах. commitTransaction() переносит
+ * диапазон кадра в одну TransactionCommand, rollbackTransaction() отменяет его на месте.
+ *
+ * Команды, создаваемые внутри транзакции через emplace(), размещаются в арене этой транзакции,
+ * а не отдельными new / delete. Арена переходит к TransactionCommand и освобождается целиком,
+ * когда команда транзакции удаляется (вытеснение, clear(), отмена транзакции).
+ *
+ * С openJournal() все команды, попадающие в историю самого стека (не открытой транзакции), а также
+ * undo / redo / clear на этом уровне дописываются в файл журнала. Из памяти команды старше последних
+ * journalWindow() заменяются ссылками на журнал и восстанавливаются из отображённого в память файла,
+ * когда до них доходит undo. После сбоя openJournal(path, window, true) воспроизводит журнал: заново
+ * выполняет redo() записанных команд и восстанавливает историю. Журналируются только команды,
+ * реализующие MUndoSerializableCommand (и транзакции из них); остальные остаются в памяти, а
+ * воспроизведение журнала останавливается на первой такой команде.
+ *
+ * Историю можно ограничить по числу команд (undoLimit) и по оценке занимаемой памяти (memoryLimit).
+ * При превышении любого из ограничений самые старые команды удаляются. Внутри открытой транзакции
+ * команды не вытесняются: транзакция учитывается целиком после commitTransaction().
+ *
+ * Как и QUndoStack, при push() команда с тем же id(), что и последняя, сливается с ней через mergeWith(),
+ * в том числе внутри транзакции. С mergeInterval() > 0 сливаются только команды, добавленные не позже
+ * чем через mergeInterval() миллисекунд после предыдущей: непрерывное редактирование (перетаскивание
+ * ползунка, набор текста) становится одной командой, а правки, разнесённые во времени, остаются отдельными.
+ *
+ * index() и setIndex() относятся к текущему уровню (открытой транзакции или самому стеку). setIndex()
+ * выполняет все шаги undo / redo подряд, а indexChanged() / canUndoChanged() / canRedoChanged() / cleanChanged()
+ * приходят один раз по окончании. Перед многошаговым переходом приходит indexJumpStarted(), после него -
+ * indexJumpFinished(): на это время клиенты могут приостановить собственные дорогие уведомления моделей.
+ *
+ * setInstrumentationEnabled(true) включает замеры: время каждого undo() / redo() (в том числе команд внутри
+ * транзакций) и размер команды собираются в гистограммы по типам команд, instrumentationReport() отдаёт их в JSON.
+ * Выключенные замеры стоят одной проверки на вызов.
  */
 class MOVAVIWIDGET_API MUndoStack : public QObject
 {
 	Q_OBJECT
 
 	class TransactionCommand;
+	class Arena;
+	class Journal;
+	class OffloadedCommand;
+	class NotificationBatch;
+	friend class MUndoStackInstrumentation;
 
 public:
 	MUndoStack(QObject *parent = 0);
@@ -25,11 +107,78 @@ public:
 	bool canRedo() const;
 	bool canUndo() const;
 
+	int index() const; ///< число выполненных команд текущего уровня
+	int cleanIndex() const; ///< index() самого стека в сохранённом состоянии, -1 - если оно недостижимо
+	bool isClean() const;
+
 	void push(QUndoCommand *);
 
+	/// @brief Создаёт команду T(args...) и добавляет её как push()
+	/// @details Внутри транзакции команда размещается в арене транзакции. Указатель на команду не возвращается:
+	/// после слияния через mergeWith() она уже уничтожена.
+	template<class T, class... Args>
+	void emplace(Args &&... args)
+	{
+		static_assert(std::is_base_of<QUndoCommand, T>::value, "T must be a QUndoCommand");
+		if (void * memory = allocate(sizeof(T), alignof(T)))
+			push(new (memory) T(std::forward<Args>(args)...));
+		else
+			push(new T(std::forward<Args>(args)...));
+	}
+
+	int undoLimit() const;
+	void setUndoLimit(int limit); ///< максимальное число undo-команд в истории, 0 - без ограничения
+
+	qint64 memoryLimit() const;
+	void setMemoryLimit(qint64 bytes); ///< максимальный объём истории в байтах, 0 - без ограничения
+
+	qint64 historyMemory() const; ///< текущий объём истории (undo и redo, включая открытые транзакции) в байтах
+
+	int mergeInterval() const;
+	void setMergeInterval(int msecs); ///< окно слияния команд в миллисекундах, 0 - сливать без учёта времени
+
+	/// @brief Оценка памяти, занимаемой командой вместе с её дочерними командами
+	static qint64 commandSize(const QUndoCommand * command);
+
+	/// @brief Фабрика команды: читает данные, записанные MUndoSerializableCommand::serialize()
+	using CommandFactory = std::function<QUndoCommand * (QDataStream &)>;
+	static void registerCommandType(const QByteArray & typeName, CommandFactory factory);
+
+	/**
+	 * @brief Включает журнал в файле @a path
+	 * @a memoryWindow - сколько последних команд истории держать в памяти (не меньше 1)
+	 * @a replay - восстановить историю из существующего журнала и продолжить писать в него;
+	 * иначе файл перезаписывается. Текущая история при восстановлении заменяется историей из журнала.
+	 * @return false, если файл не открылся или журнал удалось воспроизвести лишь частично
+	 */
+	bool openJournal(const QString & path, int memoryWindow = 100, bool replay = false);
+	void closeJournal(); ///< возвращает выгруженные команды в память и закрывает файл
+	bool isJournalOpen() const;
+	int journalWindow() const;
+
+	bool isInstrumentationEnabled() const;
+	void setInstrumentationEnabled(bool enabled); ///< при выключении собранная статистика удаляется
+	void resetInstrumentation();
+	/// @brief Статистика по типам команд в JSON: число вызовов, суммарное и максимальное время,
+	/// гистограммы времени undo / redo, размеры команд и самый медленный вызов с текстом команды
+	QByteArray instrumentationReport() const;
+
+signals:
+	void historyMemoryChanged(qint64 bytes);
+
+	void indexChanged(int index);
+	void canUndoChanged(bool canUndo);
+	void canRedoChanged(bool canRedo);
+	void cleanChanged(bool clean);
+
+	void indexJumpStarted(int from, int to); ///< перед setIndex(), требующим больше одного шага
+	void indexJumpFinished();
+
 public slots:
 	void undo();
 	void redo();
+	void setIndex(int index);
+	void setClean(); ///< запоминает текущее состояние самого стека как сохранённое
 
 	void    startTransaction();
 	void   commitTransaction();
@@ -38,27 +187,79 @@ public slots:
 	void clear();
 
 protected:
-	int count() const;
+	int count() const; // Число undo-команд текущего уровня (открытой транзакции или самого стека)
 	QUndoCommand * command(int index);
 
-	void clearNoDelete(); // Очистить список комманд, но не удалять их
+	void clearNoDelete(); // Очистить список комманд, но не удалять их (кроме размещённых в аренах открытых транзакций)
 
 private:
-	void removeUndoCommands();
-	void removeRedoCommands();
+	/// Начало уровня открытой транзакции в m_undoCommands и m_redoCommands
+	struct Frame
+	{
+		int     undoStart;
+		int     redoStart;
+		Arena * arena; ///< создаётся при первом emplace() в транзакции
+	};
+
+	/// Состояние, об изменении которого сообщают сигналы; сравнивается в конце внешнего NotificationBatch
+	struct NotificationState
+	{
+		int  index;
+		bool canUndo;
+		bool canRedo;
+		bool clean;
+	};
+	NotificationState notificationState() const;
+
+	int undoStart() const;
+	int redoStart() const;
+	int rootIndex() const;
+	Arena * currentArena() const;
 
-	const MUndoStack * currentStack() const;
-	      MUndoStack * currentStack();
+	bool undoStep();
+	bool redoStep();
+	void execute(QUndoCommand * command, bool undo); // undo() / redo() команды, с замером при включённой инструментации
 
-	void undoImpl();
-	void redoImpl();
+	static QByteArray commandTypeName(const QUndoCommand * command);
 
-	bool canRedoImpl() const;
-	bool canUndoImpl() const;
+	void * allocate(size_t size, size_t align); // память в арене текущей транзакции или nullptr
+	static void destroyCommand(QUndoCommand * command, const Arena * arena);
+
+	bool journalWritable() const;
+	void offloadToJournal();
+	QUndoCommand * materialize(int index); // возвращает команду из журнала в память; nullptr, если это невозможно
+	bool replayJournal();
+
+	static bool writeCommand(QDataStream & stream, const QUndoCommand * command);
+	static QUndoCommand * readCommand(QDataStream & stream);
+
+	qint64 deleteCommands(QVector<QUndoCommand *> & commands, int from, int to, const Arena * arena = nullptr); // удаляет [from, to), возвращает их размер
+	void removeRedoCommands(); // redo-команды текущего уровня
+
+	void addHistoryMemory(qint64 delta);
+	void applyLimits();
 
 	void pushImpl(QUndoCommand *);
+	bool tryMerge(QUndoCommand *);
 private:
-	QStack<QUndoCommand *> m_undoCommands;
-	QStack<QUndoCommand *> m_redoCommands;
-	QStack<MUndoStack   *> m_transactions;
+	QVector<QUndoCommand *> m_undoCommands;
+	QVector<QUndoCommand *> m_redoCommands;
+	QStack<Frame>           m_transactions;
+
+	int    m_undoLimit = 0;
+	qint64 m_memoryLimit = 0;
+	qint64 m_historyMemory = 0;
+
+	int           m_mergeInterval = 0;
+	QElapsedTimer m_lastPush; ///< время последнего push(), сбрасывается при undo / redo
+
+	int               m_cleanIndex = 0;
+	int               m_notificationDepth = 0;
+	NotificationState m_notificationState = NotificationState();
+
+	QScopedPointer<MUndoStackInstrumentation> m_instrumentation;
+
+	QScopedPointer<Journal>             m_journal;
+	QHash<const QUndoCommand *, qint64> m_journalOffsets; ///< где в журнале записаны команды истории, которые не менялись после записи
+	int                                 m_offloaded = 0;  ///< все заместители выгруженных команд лежат ниже этого индекса; команды ниже него выгружены, не сериализуемы или уже восстановлены
 };